@@ -1,19 +1,54 @@
+#include <array>
+#include <atomic>
+#include <algorithm>
 #include <cctype>
+#include <cerrno>
+#include <cmath>
 #include <chrono>
+#include <condition_variable>
 #include <csignal>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <fstream>
+#include <functional>
 #include <iomanip>
 #include <iostream>
 #include <random>
 #include <thread>
+#include <type_traits>
 #include <unordered_map>
+#include <unordered_set>
 #include <limits>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <new>
 
 #include <assimp/scene.h>
 #include <assimp/postprocess.h>
 #include <assimp/Importer.hpp>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#ifdef __linux__
+#include <linux/gpio.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#endif
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include "SDL.h"
 #include "SDL_mixer.h"
 
@@ -33,6 +68,29 @@
 #include <glm/ext.hpp>
 #include <glm/gtx/string_cast.hpp>
 
+#ifdef COUNT_ALLOCATIONS
+// Heap allocations made by each thread, for --check_sequence_allocations.
+// Only builds for checking, as make audiomixserver_check does, replace
+// the allocator to count them.
+thread_local size_t heap_allocations = 0;
+
+void *operator new(size_t size) {
+  ++heap_allocations;
+  if (auto p = std::malloc(size ? size : 1)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+// out of line, so the compiler doesn't pair free with new at call sites
+__attribute__((noinline)) void operator delete(void *p) noexcept {
+  std::free(p);
+}
+__attribute__((noinline)) void operator delete(void *p, size_t) noexcept {
+  std::free(p);
+}
+#endif
+
 namespace {
 typedef uint64_t sequence_t;
 
@@ -53,19 +111,6 @@ std::unordered_map<char, std::string> const &character_to_morse{
     {'Z', "--.."},
 };
 
-void fire_server_http_request_done(struct evhttp_request * req, void *arg) {
-  if (!req) {
-    std::cerr << "fire_server_http_request_done failed" << std::endl;
-    return;
-  }
-
-  auto evbuf = evhttp_request_get_input_buffer(req);
-  auto len = evbuffer_get_length(evbuf);
-  std::cout << "fire_server_http_request_done " << evbuffer_pullup(evbuf, len) << std::endl;
-  
-  evbuffer_drain(evbuf, len);  
-}
-
   
 void clear_gl_errors_helper(char const *function, int line) {
   auto err = glGetError();
@@ -476,15 +521,185 @@ struct helio_gl_sprites {
   }
 };
 
+// Compact binary UDP protocol, told apart from the text
+// audiomixclient/audiomixserver/3 protocol by its first three bytes.
+// Every field is big endian and every message is 32 bytes.
+//
+// request:
+//   0  "AMB" then the protocol version
+//   4  binary_command, then 3 reserved bytes
+//   8  client token, deduplicated per remote as for the text protocol
+//   16 sequence for queue and stop, payload for ping
+//   24 sample index, then 4 reserved bytes
+//   32 optional: microseconds since the epoch to play or queue at, as
+//      in the TIME line of text replies; such requests are 40 bytes
+//
+// reply:
+//   0  "AMB" then the protocol version
+//   4  binary_status, then 3 reserved bytes
+//   8  client token
+//   16 sequence played or queued, last token for ALREADY, ping payload,
+//      microseconds too late for LATE
+//   24 server time in microseconds since the epoch
+char const binary_protocol_magic[3] = {'A', 'M', 'B'};
+uint8_t const binary_protocol_version = 1;
+size_t const binary_message_size = 32;
+
+enum binary_command : uint8_t {
+  binary_ping = 1,
+  binary_reset = 2,
+  binary_play = 3,
+  binary_queue = 4,
+  binary_stop = 5,
+};
+
+enum binary_status : uint8_t {
+  binary_playing = 0,
+  binary_queued = 1,
+  binary_wait = 2,
+  binary_stopped = 3,
+  binary_pong = 4,
+  binary_already = 5,
+  binary_failed = 6,
+  binary_no_sample = 7,
+  binary_loading = 8,
+  binary_bad_request = 9,
+  binary_busy = 10,
+  binary_late = 11,
+};
+
+struct binary_request {
+  uint8_t command;
+  uint64_t token;
+  uint64_t sequence;
+  uint32_t index;
+  int64_t at_micros; // 0 for now
+};
+
+struct context;
+
+// A UDP request parsed on a --udp_threads thread, waiting for the
+// libevent thread to execute it and send the reply
+struct udp_work {
+  evutil_socket_t work_sock;
+  sockaddr_storage work_addr;
+  socklen_t work_addr_len;
+  uint64_t work_token;
+  evhttp_uri *work_uri; // text requests, freed once executed
+  binary_request work_binary;
+  int64_t work_received_nanos;
+};
+
+uint64_t load_be(char const *p, int bytes) {
+  uint64_t ret = 0;
+  for (int i = 0; bytes > i; ++i) {
+    ret = (ret << 8) | uint8_t(p[i]);
+  }
+  return ret;
+}
+
+void store_be64(char *p, uint64_t value) {
+  for (int i = 8; i--;) {
+    p[i] = char(value & 0xff);
+    value >>= 8;
+  }
+}
+
+// the wall clock, as SO_TIMESTAMPNS stamps datagrams with
+int64_t now_nanos() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+#ifdef __linux__
+// Preallocated buffers for draining a UDP socket with recvmmsg and
+// answering the whole batch with one sendmmsg.
+struct udp_batch {
+  static size_t const buffer_size = 1 << 16;
+  unsigned const batch_size;
+  std::vector<char> buffers;
+  std::vector<sockaddr_storage> addrs;
+  std::vector<iovec> iovecs;
+  std::vector<mmsghdr> messages;
+  // room for the SO_TIMESTAMPNS of each datagram
+  std::vector<std::array<char, CMSG_SPACE(sizeof(timespec))>> controls;
+  std::vector<std::string> text_replies;
+  std::vector<std::array<char, binary_message_size>> binary_replies;
+  std::vector<iovec> reply_iovecs;
+  std::vector<mmsghdr> reply_messages;
+
+  explicit udp_batch(unsigned size)
+      : batch_size(size), buffers(size * buffer_size), addrs(size),
+        iovecs(size), messages(size), controls(size), text_replies(size),
+        binary_replies(size), reply_iovecs(size), reply_messages(size) {}
+
+  char *buffer(unsigned i) { return buffers.data() + i * buffer_size; }
+
+  void prepare_receive() {
+    for (unsigned i = 0; batch_size > i; ++i) {
+      iovecs[i] = {buffer(i), buffer_size};
+      messages[i] = mmsghdr{};
+      messages[i].msg_hdr.msg_name = &addrs[i];
+      messages[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+      messages[i].msg_hdr.msg_iov = &iovecs[i];
+      messages[i].msg_hdr.msg_iovlen = 1;
+      messages[i].msg_hdr.msg_control = controls[i].data();
+      messages[i].msg_hdr.msg_controllen = controls[i].size();
+    }
+  }
+
+  // when the kernel received datagram i, or now if it didn't say
+  int64_t received_nanos(unsigned i) {
+    auto &header = messages[i].msg_hdr;
+    for (auto c = CMSG_FIRSTHDR(&header); c; c = CMSG_NXTHDR(&header, c)) {
+      if (SOL_SOCKET == c->cmsg_level && SCM_TIMESTAMPNS == c->cmsg_type) {
+        timespec ts;
+        std::memcpy(&ts, CMSG_DATA(c), sizeof(ts));
+        return int64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+      }
+    }
+    return now_nanos();
+  }
+
+  void add_reply(unsigned replies, unsigned i, char const *reply, size_t len) {
+    reply_iovecs[replies] = {const_cast<char *>(reply), len};
+    reply_messages[replies] = mmsghdr{};
+    reply_messages[replies].msg_hdr.msg_name = &addrs[i];
+    reply_messages[replies].msg_hdr.msg_namelen =
+        messages[i].msg_hdr.msg_namelen;
+    reply_messages[replies].msg_hdr.msg_iov = &reply_iovecs[replies];
+    reply_messages[replies].msg_hdr.msg_iovlen = 1;
+  }
+};
+#endif
+
+// how play, queue and set may change the way a sequence sounds; all but
+// the defaults need the lockfree mixer
+struct play_options {
+  float rate = 1; // playback speed, which shifts the pitch too
+  float gain = 1;
+  float pan = 0; // -1 left to 1 right
+  int fade_in_ms = 0;
+  int fade_out_ms = 0; // at the end, or when stopped
+  int loops = 0;       // times to go round again, -1 for ever
+  int bus = 0;         // index in context::bus_names
+};
+
 struct sequence_status {
   Mix_Chunk *sequence_chunk;
   int sequence_channel;
+  // the SDL_mixer channel its predecessor has it chained on, -1 if none
+  int sequence_chained_channel;
   sequence_t next_sequence;
   float sequence_brightness;
+  uint64_t sequence_start_frame; // 0 to start straight away
+  play_options sequence_options;
 
   sequence_status(Mix_Chunk *chunk)
-      : sequence_chunk(chunk), sequence_channel(-1), next_sequence(0),
-        sequence_brightness(0) {}
+      : sequence_chunk(chunk), sequence_channel(-1),
+        sequence_chained_channel(-1), next_sequence(0),
+        sequence_brightness(0), sequence_start_frame(0) {}
 };
 
 std::unordered_map<std::string, std::string> uri_params(evhttp_uri const *uri) {
@@ -505,6 +720,34 @@ std::unordered_map<std::string, std::string> uri_params(evhttp_uri const *uri) {
   return ret;
 }
 
+std::string upper_case(std::string str) {
+  for (auto &c : str) {
+    c = std::toupper(c);
+  }
+  return str;
+}
+
+// reads params[name], if given, into value; false with BAD <NAME>
+// written to out unless it is a number from lowest to highest
+template <typename T>
+bool read_param(std::unordered_map<std::string, std::string> &params,
+                char const *name, double lowest, double highest, T &value,
+                std::ostream &out) {
+  auto const &str = params[name];
+  if (str.empty()) {
+    return true;
+  }
+  char *end;
+  auto parsed = std::strtod(str.c_str(), &end);
+  if (*end || !(parsed >= lowest && highest >= parsed) ||
+      (std::is_integral<T>::value && std::floor(parsed) != parsed)) {
+    out << "BAD " << upper_case(name) << " " << str << std::endl;
+    return false;
+  }
+  value = parsed;
+  return true;
+}
+
 std::chrono::time_point<std::chrono::system_clock> start =
     std::chrono::system_clock::now();
 long time_millis() {
@@ -518,351 +761,4866 @@ sequence_t random_sequence_number() {
   return dist(rnd);
 }
 
-bool starts_with(std::string const &prefix, std::string const &str) {
-  return str.compare(0, prefix.size(), prefix) == 0;
-}
+// Preallocated slots for every sequence playing or queued, so play,
+// queue, stop and finish never allocate. A sequence number holds its slot
+// in the low bits and the slot's generation above them, so a stale number
+// never finds the sequence that reused its slot.
+struct sequence_table {
+  struct slot {
+    sequence_t slot_sequence = 0; // 0 while free
+    sequence_t slot_generation = random_sequence_number();
+    sequence_status slot_status{nullptr};
+  };
+
+  unsigned const slot_bits;
+  std::vector<slot> slots;
+  std::vector<uint32_t> free_slots;
+  std::vector<sequence_t> channel_sequences; // channel -> sequence on it
+
+  sequence_table(size_t slot_count, size_t channel_count)
+      : slot_bits(bits_for(slot_count)),
+        slots(slot_count), channel_sequences(channel_count) {
+    free_slots.reserve(slot_count);
+    for (auto slot = slot_count; slot--;) {
+      free_slots.push_back(slot);
+    }
+  }
 
-struct lock_sdl_audio {
-  lock_sdl_audio() { SDL_LockAudio(); }
-  ~lock_sdl_audio() { SDL_UnlockAudio(); }
-};
+  // 0 when every slot is taken
+  sequence_t add(Mix_Chunk *chunk) {
+    if (free_slots.empty()) {
+      return 0;
+    }
+    auto index = free_slots.back();
+    free_slots.pop_back();
+    auto &s = slots[index];
+    do {
+      s.slot_sequence = (++s.slot_generation << slot_bits) | index;
+    } while (!s.slot_sequence);
+    s.slot_status = sequence_status{chunk};
+    return s.slot_sequence;
+  }
 
-struct context {
-  std::unordered_map<std::string, Mix_Chunk *> chunks;
-  std::unordered_map<std::string, uint64_t> client_tokens;
-  std::vector<Mix_Chunk *> ordered_chunks;
-  boost::program_options::variables_map &vm;
-  struct event udp_event;
-  struct evhttp_connection* fire_server_connection;
+  sequence_status *find(sequence_t sequence) {
+    auto index = sequence & ((sequence_t(1) << slot_bits) - 1);
+    if (!sequence || index >= slots.size() ||
+        slots[index].slot_sequence != sequence) {
+      return nullptr;
+    }
+    return &slots[index].slot_status;
+  }
 
-  std::unordered_map<int, sequence_t> channel_to_sequence;
-  std::unordered_map<sequence_t, sequence_status> sequence_to_status;
-  sequence_t sequence = random_sequence_number();
+  void erase(sequence_t sequence) {
+    if (find(sequence)) {
+      auto index = sequence & ((sequence_t(1) << slot_bits) - 1);
+      slots[index].slot_sequence = 0;
+      free_slots.push_back(index);
+    }
+  }
 
-  GLclampf background_r;
-  GLclampf background_g;
-  GLclampf background_b;
+  sequence_t &channel(int channel) { return channel_sequences[channel]; }
 
-  helio_gl_rainbow gl_rainbow;
-  helio_gl_lozenge gl_lozenge;
-  helio_gl_sprites gl_sprites;
+  // whether anything is playing, or fading out, that has still to finish
+  bool any_channel() const {
+    return std::any_of(channel_sequences.begin(), channel_sequences.end(),
+                       [](sequence_t sequence) { return sequence != 0; });
+  }
 
-  context(boost::program_options::variables_map &vm_)
-      : vm(vm_), background_r(0), background_g(0), background_b(0) {}
+  static unsigned bits_for(size_t count) {
+    unsigned bits = 0;
+    while (count > size_t(1) << bits) {
+      ++bits;
+    }
+    return bits;
+  }
 
-  context(const context&) = delete;
+  template <typename F> void for_each(F &&f) {
+    for (auto &s : slots) {
+      if (s.slot_sequence) {
+        f(s.slot_sequence, s.slot_status);
+      }
+    }
+  }
+};
 
-  Mix_Chunk *name_to_chunk(std::string const &name) {
-    auto p = chunks.find(name);
+// Chooses a voice to fade out for a new sequence once voice_limit
+// voices are sounding, under --voice_stealing. The stolen voice fades
+// out on one of a few extra voices kept back for that.
+struct voice_stealer {
+  enum policy_type {
+    no_stealing,
+    steal_oldest,
+    steal_quietest,
+    steal_by_priority
+  };
+  policy_type policy = no_stealing;
+  int const voice_limit;
+  int sounding = 0;
+  uint64_t starts = 0;
+  // per channel: start order, 0 while idle or fading out
+  std::vector<uint64_t> started;
+  std::vector<int> priorities;
+  std::vector<float> levels;
+  uint64_t steals = 0;
+  uint64_t rejections = 0;
+
+  voice_stealer(int limit, int channel_count)
+      : voice_limit(limit), started(channel_count),
+        priorities(channel_count), levels(channel_count) {}
+
+  bool has_room() const {
+    return policy == no_stealing || voice_limit > sounding;
+  }
 
-    if (ordered_chunks.empty()) {
-      std::cout << "No songs loaded - pass them at the command line"
-                << std::endl;
-      return 0;
+  void start(int channel, int priority, float level) {
+    if (!started[channel]) {
+      ++sounding;
     }
-    if (p != chunks.end()) {
-      std::cerr << "Chunk " << name << " is " << p->second << std::endl;
-      return p->second;
+    started[channel] = ++starts;
+    priorities[channel] = priority;
+    levels[channel] = level;
+  }
+
+  void release(int channel) {
+    if (started[channel]) {
+      started[channel] = 0;
+      --sounding;
     }
+  }
 
-    if (name == "play" || name == "/play" || name.empty()) {
-      return ordered_chunks[0];
+  // the channel to fade out for a sequence of priority, or -1
+  int victim(int priority) const {
+    int best = -1;
+    for (int channel = 0; int(started.size()) > channel; ++channel) {
+      if (!started[channel] ||
+          (policy == steal_by_priority && priorities[channel] > priority)) {
+        continue;
+      }
+      if (best < 0 || before(channel, best)) {
+        best = channel;
+      }
     }
+    return best;
+  }
 
-    unsigned long index;
-    try {
-      index = std::stoul(name);
-    } catch (std::exception &e) {
-      std::cout << "Unknown song " << name << std::endl;
-      return 0;
+  // true if channel a goes before channel b, falling back to the oldest
+  bool before(int a, int b) const {
+    if (policy == steal_quietest && levels[a] != levels[b]) {
+      return levels[b] > levels[a];
+    }
+    if (policy == steal_by_priority && priorities[a] != priorities[b]) {
+      return priorities[b] > priorities[a];
     }
-    return ordered_chunks[index % ordered_chunks.size()];
+    return started[b] > started[a];
   }
+};
 
-  sequence_t play(std::string const &name) {
-    auto chunk = name_to_chunk(name);
-    if (!chunk) {
-      return 0;
+// seconds since the epoch with up to six decimals, as in the TIME line
+bool parse_time_micros(std::string const &str, int64_t &micros) {
+  auto dot = str.find('.');
+  auto seconds = str.substr(0, dot);
+  if (seconds.empty() || seconds.size() > 12 ||
+      !std::all_of(seconds.begin(), seconds.end(),
+                   [](unsigned char c) { return std::isdigit(c); })) {
+    return false;
+  }
+  int64_t fraction = 0;
+  int digits = 0;
+  if (dot != std::string::npos) {
+    for (auto c : str.substr(dot + 1)) {
+      if (!std::isdigit(static_cast<unsigned char>(c))) {
+        return false;
+      }
+      if (6 > digits) {
+        fraction = fraction * 10 + (c - '0');
+        ++digits;
+      }
     }
-    return play(chunk);
   }
+  for (; 6 > digits; ++digits) {
+    fraction *= 10;
+  }
+  micros = std::stoll(seconds) * 1000000 + fraction;
+  return true;
+}
 
-  sequence_t play_morse(std::string const &morse) {
-    gl_lozenge.lozenge_message = morse;
-    gl_rainbow.fire_start = 1;
-    make_fire_server_request(vm["fire_server_start_path"].as<std::string>());
-    
-    auto dot = load_to_chunk("morse_dot.wav");
-    auto dash = load_to_chunk("morse_dash.wav");
-    auto space = load_to_chunk("morse_space.wav");
-    auto gap = load_to_chunk("morse_gap.wav");
+bool starts_with(std::string const &prefix, std::string const &str) {
+  return str.compare(0, prefix.size(), prefix) == 0;
+}
 
-    lock_sdl_audio _;
-    sequence_status *last_status = nullptr;
-    sequence_t first_sequence = 0;
-    auto add_chunk = [&](Mix_Chunk *chunk, double brightness = 0) {
-      if (!chunk) {
-        return;
-      }
+size_t round_up_power_of_two(size_t n) {
+  size_t ret = 1;
+  while (ret < n) {
+    ret <<= 1;
+  }
+  return ret;
+}
 
-      auto i = sequence_to_status
-                   .emplace(fresh_sequence_number(), sequence_status{chunk})
-                   .first;
-      i->second.sequence_brightness = brightness;
-      if (last_status) {
-        last_status->next_sequence = i->first;
-      }
-      if (!first_sequence) {
-        first_sequence = i->first;
-      }
+// One thread pushes, one other thread pops, and neither ever blocks:
+// a full ring makes push fail and an empty one makes pop fail.
+template <typename T> struct spsc_ring {
+  std::vector<T> slots;
+  size_t const mask;
+  alignas(64) std::atomic<size_t> head{0}; // advanced by the consumer
+  alignas(64) std::atomic<size_t> tail{0}; // advanced by the producer
 
-      last_status = &i->second;
-    };
+  explicit spsc_ring(size_t capacity)
+      : slots(round_up_power_of_two(capacity)), mask(slots.size() - 1) {}
 
-    for (auto const &c : morse) {
-      Mix_Chunk *chunk = nullptr;
-      auto brightness = 0.0;
-      switch (c) {
-      case '.':
-        chunk = dot;
-        brightness = .9;
-        break;
-      case '-':
-        chunk = dash;
-        brightness = 1.0;
-        break;
-      case ' ':
-        chunk = space;
-        break;
-      }
-      add_chunk(chunk, brightness);
-      add_chunk(gap);
+  bool push(T const &item) {
+    auto t = tail.load(std::memory_order_relaxed);
+    if (t - head.load(std::memory_order_acquire) > mask) {
+      return false;
     }
+    slots[t & mask] = item;
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+  }
 
-    if (!first_sequence) {
-      return 0;
+  bool pop(T &item) {
+    auto h = head.load(std::memory_order_relaxed);
+    if (h == tail.load(std::memory_order_acquire)) {
+      return false;
     }
+    item = slots[h & mask];
+    head.store(h + 1, std::memory_order_release);
+    return true;
+  }
 
-    return start_sequence(sequence_to_status.find(first_sequence));
+  // from any thread, but only a hint unless it is the consumer's
+  bool empty() const {
+    return head.load(std::memory_order_acquire) ==
+           tail.load(std::memory_order_acquire);
   }
+};
 
-  sequence_t fresh_sequence_number() {
-    auto new_sequence = ++sequence;
-    if (0 == sequence) {
-      new_sequence = ++sequence;
+// Bounded queue any number of threads push to and one thread pops from,
+// after Dmitry Vyukov's: each cell carries the position it is next valid
+// for, so producers only contend on claiming a position.
+template <typename T> struct mpsc_ring {
+  struct cell {
+    std::atomic<size_t> cell_position;
+    T item;
+  };
+  std::unique_ptr<cell[]> cells;
+  size_t const mask;
+  alignas(64) std::atomic<size_t> tail{0}; // claimed by producers
+  alignas(64) size_t head = 0;             // consumer only
+
+  explicit mpsc_ring(size_t capacity)
+      : cells(new cell[round_up_power_of_two(capacity)]),
+        mask(round_up_power_of_two(capacity) - 1) {
+    for (size_t i = 0; mask >= i; ++i) {
+      cells[i].cell_position = i;
     }
-    return new_sequence;
   }
 
-  sequence_t play(Mix_Chunk *chunk) {
-    lock_sdl_audio _;
-    auto i = sequence_to_status.emplace(fresh_sequence_number(),
-                                        sequence_status{chunk});
-    return start_sequence(i.first);
+  bool push(T const &item) {
+    auto position = tail.load(std::memory_order_relaxed);
+    cell *c;
+    for (;;) {
+      c = &cells[position & mask];
+      auto ready = c->cell_position.load(std::memory_order_acquire);
+      auto diff = intptr_t(ready) - intptr_t(position);
+      if (!diff) {
+        if (tail.compare_exchange_weak(position, position + 1,
+                                       std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        position = tail.load(std::memory_order_relaxed);
+      }
+    }
+    c->item = item;
+    c->cell_position.store(position + 1, std::memory_order_release);
+    return true;
   }
 
-  void set_brightness(float brightness) {
-
-    if (vm["flash_screen"].as<bool>()) {
-      background_r = brightness;
-      background_g = brightness;
-      background_b = brightness;
+  bool pop(T &item) {
+    auto c = &cells[head & mask];
+    if (c->cell_position.load(std::memory_order_acquire) != head + 1) {
+      return false;
     }
+    item = c->item;
+    c->cell_position.store(head + mask + 1, std::memory_order_release);
+    ++head;
+    return true;
+  }
+};
 
-    auto laser_level = brightness > 0.5 ? 1 : 0;
-
-    auto option = vm["gpio_path"];
-    if (!option.empty()) {
-      std::ofstream laser_gpio{option.as<std::string>()};
-      laser_gpio << (laser_level ^ vm["gpio_off_value"].as<int>());
+// Logging off the hot paths. A log call copies its format, a string
+// literal with {} for each argument, and the arguments into a fixed size
+// record on the calling thread's own ring and returns; the log thread
+// formats and writes them. After a thread's first message nothing
+// blocks or allocates, and a full ring drops the message and counts it
+// rather than waiting.
+enum log_level {
+  level_debug,
+  level_info,
+  level_warning,
+  level_error,
+  level_off
+};
+char const *const log_level_names[] = {"debug", "info", "warning", "error",
+                                       "off"};
+
+std::atomic<int> log_threshold{level_info};
+
+struct log_record {
+  static int const max_args = 8;
+  static size_t const text_size = 192;
+  enum arg_type : uint8_t {
+    arg_signed,
+    arg_unsigned,
+    arg_double,
+    arg_pointer,
+    arg_text
+  };
+  char const *record_format;
+  uint8_t record_level;
+  uint8_t record_args;
+  uint16_t text_used;
+  arg_type types[max_args];
+  uint64_t values[max_args]; // the bits of each, or its offset in text
+  char text[text_size];      // string arguments, nul terminated, truncated
+
+  void add(arg_type type, uint64_t value) {
+    if (max_args > record_args) {
+      types[record_args] = type;
+      values[record_args++] = value;
     }
   }
 
-  sequence_t start_sequence(decltype(sequence_to_status)::iterator const &i) {
-    int channel = Mix_PlayChannel(-1, i->second.sequence_chunk, 0);
-    if (channel < 0) {
-      std::cerr << "Mix_PlayChannel " << channel << " " << Mix_GetError()
-                << " for sequence " << i->first << std::endl;
-      sequence_done(i->first);
-      return 0;
-    } else {
-      std::cout << time_millis() << " playing " << i->first << " on channel "
-                << channel << std::endl;
+  void add_text(char const *str) {
+    if (!str) {
+      str = "(null)";
     }
+    auto length = std::min(std::strlen(str), text_size - 1 - text_used);
+    std::memcpy(text + text_used, str, length);
+    text[text_used + length] = 0;
+    add(arg_text, text_used);
+    text_used += length + 1;
+  }
 
-    set_brightness(i->second.sequence_brightness);
-
-    channel_to_sequence[channel] = i->first;
-    i->second.sequence_channel = channel;
-    return i->first;
+  void write(std::string &line) const {
+    line.clear();
+    int arg = 0;
+    for (auto f = record_format; *f; ++f) {
+      if ('{' != f[0] || '}' != f[1] || arg >= record_args) {
+        line += *f;
+        continue;
+      }
+      ++f;
+      char number[32];
+      auto value = values[arg];
+      switch (types[arg++]) {
+      case arg_signed:
+        std::snprintf(number, sizeof(number), "%lld", (long long)value);
+        break;
+      case arg_unsigned:
+        std::snprintf(number, sizeof(number), "%llu",
+                      (unsigned long long)value);
+        break;
+      case arg_double: {
+        double d;
+        std::memcpy(&d, &value, sizeof(d));
+        std::snprintf(number, sizeof(number), "%g", d);
+        break;
+      }
+      case arg_pointer:
+        std::snprintf(number, sizeof(number), value ? "%p" : "0",
+                      reinterpret_cast<void *>(value));
+        break;
+      case arg_text:
+        line += text + value;
+        continue;
+      }
+      line += number;
+    }
   }
+};
 
-  void handle_http_request(evhttp_request *req) {
-    char *address;
-    ev_uint16_t port;
-    struct evhttp_connection *con = evhttp_request_get_connection(req);
-    evhttp_connection_get_peer(con, &address, &port);
+template <typename T>
+typename std::enable_if<std::is_integral<T>::value>::type
+log_arg(log_record &record, T value) {
+  record.add(std::is_signed<T>::value ? log_record::arg_signed
+                                      : log_record::arg_unsigned,
+             uint64_t(value));
+}
 
-    auto uri = evhttp_request_get_evhttp_uri(req);
+template <typename T>
+typename std::enable_if<std::is_floating_point<T>::value>::type
+log_arg(log_record &record, T value) {
+  double d = value;
+  uint64_t bits;
+  std::memcpy(&bits, &d, sizeof(bits));
+  record.add(log_record::arg_double, bits);
+}
 
-    auto path = std::string(evhttp_uri_get_path(uri));
-    std::cout << "Received HTTP request from " << address << ":" << port
-              << " for " << path << std::endl;
-    std::ostringstream out;
+template <typename T> void log_arg(log_record &record, T const *pointer) {
+  record.add(log_record::arg_pointer, reinterpret_cast<uintptr_t>(pointer));
+}
 
-    bool success = handle_request(out, uri);
+void log_arg(log_record &record, char const *str) { record.add_text(str); }
+void log_arg(log_record &record, char *str) { record.add_text(str); }
+void log_arg(log_record &record, unsigned char const *str) {
+  record.add_text(reinterpret_cast<char const *>(str));
+}
+void log_arg(log_record &record, std::string const &str) {
+  record.add_text(str.c_str());
+}
 
-    auto *buf = evhttp_request_get_output_buffer(req);
-    if (!buf) {
-      std::cerr << "evhttp_request_get_output_buffer" << std::endl;
-      return;
+// set by the audio callbacks, so that their thread takes a ring
+// allocated up front rather than allocating one
+thread_local bool log_from_audio_thread = false;
+
+struct log_writer {
+  static constexpr int max_threads = 64;
+  static size_t const ring_records = 1024;
+  static int const audio_rings = 1;
+  struct thread_log {
+    spsc_ring<log_record> records{ring_records};
+    std::atomic<bool> in_use{true}; // false once its thread has exited
+    bool for_audio = false;
+  };
+  // claimed in order and never freed; an exited thread's ring is taken
+  // over by the next new thread of the same kind
+  std::array<std::atomic<thread_log *>, max_threads> logs{};
+  std::atomic<int> log_count{0};
+  std::atomic<uint64_t> dropped{0};
+  uint64_t dropped_reported = 0; // log thread only
+  std::mutex drain_mutex;        // between the log thread and exit
+  std::condition_variable stop_requested;
+  FILE *info_file = stdout;      // debug and info; the rest go to stderr
+  bool stopped = false;
+  std::string line;
+  std::thread drainer;
+
+  thread_log *claim() {
+    bool audio = log_from_audio_thread;
+    for (int i = 0; std::min(max_threads, log_count.load()) > i; ++i) {
+      auto log = logs[i].load(std::memory_order_acquire);
+      bool exited = false;
+      if (log && log->for_audio == audio &&
+          log->in_use.compare_exchange_strong(exited, true)) {
+        return log;
+      }
     }
-    auto str = out.str();
-    if (evbuffer_add(buf, str.data(), str.length())) {
-      std::cerr << "evbuffer_add" << std::endl;
-      return;
+    if (audio) {
+      return nullptr;
     }
-
-    evhttp_send_reply(req, success ? HTTP_OK : 500, "Rock on", buf);
+    auto index = log_count.fetch_add(1);
+    if (index >= max_threads) {
+      return nullptr;
+    }
+    auto log = new thread_log;
+    logs[index].store(log, std::memory_order_release);
+    return log;
   }
 
-  void handle_udp_events(evutil_socket_t sock) {
-    struct sockaddr_storage addr;
-    char buf[1 << 16];
-    for (;;) {
-      socklen_t addr_len = sizeof(addr);
-      auto bytes = recvfrom(sock, buf, sizeof(buf), 0, (struct sockaddr *)&addr,
-                            &addr_len);
-      if (bytes < 0) {
+  void reserve_audio_rings() {
+    for (int i = 0; audio_rings > i; ++i) {
+      auto index = log_count.fetch_add(1);
+      if (index >= max_threads) {
         return;
       }
-
-      handle_udp_request(sock, std::string(buf, bytes), &addr, addr_len);
+      auto log = new thread_log;
+      log->in_use = false;
+      log->for_audio = true;
+      logs[index].store(log, std::memory_order_release);
     }
   }
 
-  std::string remote_address(const void *addr, int addr_len) {
-    switch (static_cast<const sockaddr *>(addr)->sa_family) {
-    case AF_INET: {
-      char namebuf[INET_ADDRSTRLEN];
-      auto sa = static_cast<const sockaddr_in *>(addr);
-      if (!evutil_inet_ntop(AF_INET, &sa->sin_addr, namebuf, sizeof(namebuf))) {
-        std::cerr << "evutil_inet_ntop AF_INET "
-                  << evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR())
-                  << std::endl;
-        return "<UNKNOWN-IPv4>";
+  // the calling thread's ring, claimed on first use
+  thread_log *own_log() {
+    struct owner {
+      thread_log *log = nullptr;
+      bool claimed = false;
+      ~owner() {
+        if (log) {
+          log->in_use = false;
+        }
       }
+    };
+    thread_local owner mine;
+    if (!mine.claimed) {
+      mine.log = claim();
+      mine.claimed = true;
+    }
+    return mine.log;
+  }
 
-      return std::string(namebuf) + ":" + std::to_string(ntohs(sa->sin_port));
+  // for a thread that should not allocate later, on its first message
+  void claim_ring() { own_log(); }
+
+  void push(log_record const &record) {
+    auto log = own_log();
+    if (!log || !log->records.push(record)) {
+      dropped.fetch_add(1, std::memory_order_relaxed);
     }
-    case AF_INET6: {
-      char namebuf[INET6_ADDRSTRLEN];
-      auto sa = static_cast<const sockaddr_in6 *>(addr);
-      if (!evutil_inet_ntop(AF_INET6, &sa->sin6_addr, namebuf,
-                            sizeof(namebuf))) {
-        std::cerr << "evutil_inet_ntop AF_INET6 "
-                  << evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR())
-                  << std::endl;
-        return "<UNKNOWN-IPv6>";
-      }
+  }
 
-      return std::string(namebuf) + ":" + std::to_string(ntohs(sa->sin6_port));
+  void write_records() {
+    log_record record;
+    for (int i = 0; std::min(max_threads, log_count.load()) > i; ++i) {
+      auto log = logs[i].load(std::memory_order_acquire);
+      while (log && log->records.pop(record)) {
+        record.write(line);
+        line += '\n';
+        std::fwrite(line.data(), 1, line.size(),
+                    record.record_level >= level_warning ? stderr
+                                                         : info_file);
+      }
     }
-    default:
-      return "<UNKNOWN-AF>";
+    auto now_dropped = dropped.load(std::memory_order_relaxed);
+    if (now_dropped != dropped_reported) {
+      std::fprintf(stderr, "dropped %llu log messages\n",
+                   (unsigned long long)(now_dropped - dropped_reported));
+      dropped_reported = now_dropped;
     }
+    std::fflush(info_file);
   }
 
-  bool handle_request(std::ostream &out, evhttp_uri const *uri) {
-    timeval tv;
-    if (evutil_gettimeofday(&tv, nullptr) < 0) {
-      std::cerr << "evutil_gettimeofday "
-                << evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR())
-                << std::endl;
+  // writes what has been logged every few milliseconds from now on, and
+  // what is left at exit, where the log thread is joined before static
+  // destructors run
+  void start(FILE *info) {
+    info_file = info;
+    reserve_audio_rings();
+    drainer = std::thread([this] {
+      std::unique_lock<std::mutex> lock{drain_mutex};
+      while (!stopped) {
+        write_records();
+        stop_requested.wait_for(lock, std::chrono::milliseconds(10));
+      }
+    });
+    std::atexit([] {
+      extern log_writer logger;
+      {
+        std::lock_guard<std::mutex> _{logger.drain_mutex};
+        logger.write_records();
+        logger.stopped = true;
+      }
+      logger.stop_requested.notify_one();
+      logger.drainer.join();
+    });
+  }
+};
+
+log_writer logger;
+
+template <typename... Args>
+void log_message(log_level level, char const *format, Args const &... args) {
+  if (log_threshold.load(std::memory_order_relaxed) > level) {
+    return;
+  }
+  log_record record;
+  record.record_format = format;
+  record.record_level = level;
+  record.record_args = 0;
+  record.text_used = 0;
+  int expand[] = {0, (log_arg(record, args), 0)...};
+  (void)expand;
+  logger.push(record);
+}
+
+template <typename... Args>
+void log_debug(char const *format, Args const &... args) {
+  log_message(level_debug, format, args...);
+}
+
+template <typename... Args>
+void log_info(char const *format, Args const &... args) {
+  log_message(level_info, format, args...);
+}
+
+template <typename... Args>
+void log_warning(char const *format, Args const &... args) {
+  log_message(level_warning, format, args...);
+}
+
+template <typename... Args>
+void log_error(char const *format, Args const &... args) {
+  log_message(level_error, format, args...);
+}
+
+// Counts of durations in nanoseconds, HDR style: exact below 32ns, then
+// 32 buckets for each power of two, so a percentile read back is within
+// about 3%. Recording is one relaxed add, so any thread can record,
+// the audio callback included, while another reads.
+struct latency_histogram {
+  static int const sub_bits = 5;
+  static int const buckets = (64 - sub_bits + 1) << sub_bits;
+  std::array<std::atomic<uint64_t>, buckets> counts{};
+
+  static int bucket(uint64_t nanos) {
+    if (nanos >> sub_bits == 0) {
+      return nanos;
+    }
+    int exponent = 63 - __builtin_clzll(nanos);
+    auto mantissa = (nanos >> (exponent - sub_bits)) & ((1 << sub_bits) - 1);
+    return ((exponent - sub_bits + 1) << sub_bits) + mantissa;
+  }
+
+  // the middle of bucket b
+  static double value(int b) {
+    if (b >> sub_bits == 0) {
+      return b;
+    }
+    int shift = (b >> sub_bits) - 1;
+    auto low = uint64_t((1 << sub_bits) + (b & ((1 << sub_bits) - 1)))
+               << shift;
+    return low + (uint64_t(1) << shift) / 2.;
+  }
+
+  void record(int64_t nanos) {
+    counts[bucket(std::max<int64_t>(nanos, 0))].fetch_add(
+        1, std::memory_order_relaxed);
+  }
+
+  // count and the nanoseconds at each fraction in quantiles, from counts
+  // read while recording goes on; sum, if given, gets the total
+  uint64_t read(std::vector<double> const &quantiles,
+                std::vector<double> &nanos, double *sum = nullptr) const {
+    std::array<uint64_t, buckets> snapshot;
+    uint64_t total = 0;
+    for (int b = 0; buckets > b; ++b) {
+      total += snapshot[b] = counts[b].load(std::memory_order_relaxed);
+      if (sum) {
+        *sum += snapshot[b] * value(b);
+      }
+    }
+    nanos.assign(quantiles.size(), 0);
+    for (size_t q = 0; quantiles.size() > q && total; ++q) {
+      auto rank = std::max<uint64_t>(1, std::ceil(quantiles[q] * total));
+      uint64_t seen = 0;
+      for (int b = 0; buckets > b; ++b) {
+        if ((seen += snapshot[b]) >= rank) {
+          nanos[q] = value(b);
+          break;
+        }
+      }
+    }
+    return total;
+  }
+};
+
+// Where the time goes from a request arriving to its first sample being
+// mixed, for sequences that start straight away. The last two stages
+// only exist with the lockfree mixer.
+struct trigger_latency {
+  latency_histogram receive_to_dispatch; // queued in the kernel and here
+  latency_histogram dispatch_to_start;   // handling up to starting a voice
+  latency_histogram start_to_callback;   // until the callback mixing it
+  latency_histogram receive_to_callback; // all of it
+  // scheduled sequences dropped for reaching the mixer after their
+  // start, by how long after
+  latency_histogram missed_start;
+};
+
+// Commands counted by /metrics, the binary ones first in binary_command
+// order so they need no lookup; anything else plays the sample it names
+char const *const metric_commands[] = {
+    "ping",       "reset",      "play",         "queue",
+    "stop",       "set",        "set_bus",      "remove_bus",
+    "buses",      "songs",      "sample_stats", "voice_stats",
+    "udp_stats",  "stats",      "song_count",   "play_morse_message",
+    "metrics",    "log_level",  "fire_stats"};
+size_t const metric_command_count =
+    sizeof(metric_commands) / sizeof(metric_commands[0]);
+size_t const metric_play = binary_play - binary_ping;
+
+enum transport {
+  transport_http,
+  transport_udp_text,
+  transport_udp_binary,
+  transport_script,
+  transport_count
+};
+char const *const transport_names[transport_count] = {"http", "udp_text",
+                                                      "udp_binary", "script"};
+
+// batches of up to 1, 2, 4 ... 1024 datagrams, then more
+int const udp_batch_buckets = 12;
+
+enum metric_id {
+  metric_udp_batches,
+  metric_udp_datagrams,
+  metric_udp_batch_size,
+  metric_callbacks = metric_udp_batch_size + udp_batch_buckets,
+  metric_callback_overruns, // took longer than the audio they mixed
+  metric_underruns,         // came so late the device likely ran dry
+  metric_requests,          // by command, then transport
+  metric_count = metric_requests + metric_command_count * transport_count
+};
+
+// Counters for /metrics. Each thread adds to its own cache line, which
+// no other thread writes, so counting on the hot paths is a plain load
+// and store with no locked instruction; the lines are only summed when
+// scraped. Threads beyond max_threads share the last line, atomically.
+struct metric_shards {
+  static int const max_threads = 64;
+  struct alignas(64) shard {
+    std::array<std::atomic<uint64_t>, metric_count> values{};
+  };
+  std::array<shard, max_threads> shards;
+  std::atomic<int> threads{0};
+
+  void add(metric_id id, uint64_t n = 1) {
+    thread_local shard *mine = nullptr;
+    thread_local bool shared = false;
+    if (!mine) {
+      auto index = threads.fetch_add(1);
+      shared = index >= max_threads - 1;
+      mine = &shards[std::min(max_threads - 1, index)];
+    }
+    auto &value = mine->values[id];
+    if (shared) {
+      value.fetch_add(n, std::memory_order_relaxed);
+    } else {
+      value.store(value.load(std::memory_order_relaxed) + n,
+                  std::memory_order_relaxed);
+    }
+  }
+
+  uint64_t sum(int id) const {
+    uint64_t total = 0;
+    for (auto const &s : shards) {
+      total += s.values[id].load(std::memory_order_relaxed);
+    }
+    return total;
+  }
+};
+
+metric_shards metrics;
+
+void count_request(size_t command, transport how) {
+  metrics.add(metric_id(metric_requests + command * transport_count + how));
+}
+
+void count_request(std::string const &command, transport how) {
+  size_t c = 0;
+  while (metric_command_count > c && command != metric_commands[c]) {
+    ++c;
+  }
+  count_request(metric_command_count == c ? metric_play : c, how);
+}
+
+void count_udp_batch(uint64_t datagrams) {
+  metrics.add(metric_udp_batches);
+  metrics.add(metric_udp_datagrams, datagrams);
+  int bucket = 0;
+  while (udp_batch_buckets - 1 > bucket && datagrams > uint64_t(1) << bucket) {
+    ++bucket;
+  }
+  metrics.add(metric_id(metric_udp_batch_size + bucket));
+}
+
+// Polyphase windowed-sinc filter for one cutoff. Row p holds the taps
+// for an output frame p / phases of the way past a source frame, each
+// coefficient repeated per channel to line up with interleaved PCM.
+struct resampler_table {
+  static unsigned const phase_bits = 8;
+  int const taps;
+  int const channels;
+  std::vector<float> coefficients;
+
+  // cutoff is relative to the source Nyquist frequency; taps == 2 is
+  // plain linear interpolation
+  resampler_table(int taps_, int channels_, double cutoff)
+      : taps(taps_), channels(channels_),
+        coefficients((size_t(1) << phase_bits) * taps_ * channels_) {
+    size_t phases = size_t(1) << phase_bits;
+    int half = taps / 2;
+    std::vector<double> row(taps);
+    for (size_t p = 0; phases > p; ++p) {
+      double fraction = double(p) / phases;
+      double sum = 0;
+      for (int t = 0; taps > t; ++t) {
+        double x = t - (half - 1) - fraction;
+        if (taps == 2) {
+          row[t] = std::max(0.0, 1 - std::abs(x));
+        } else {
+          double w = x / half;
+          double window = std::abs(w) >= 1 ? 0
+                                           : 0.42 + 0.5 * std::cos(M_PI * w) +
+                                                 0.08 * std::cos(2 * M_PI * w);
+          double y = M_PI * cutoff * x;
+          row[t] = window * (y == 0 ? 1 : std::sin(y) / y);
+        }
+        sum += row[t];
+      }
+      for (int t = 0; taps > t; ++t) {
+        for (int c = 0; channels > c; ++c) {
+          coefficients[(p * taps + t) * channels + c] = float(row[t] / sum);
+        }
+      }
+    }
+  }
+
+  // phase is 32.32 fixed point source frames
+  float const *row(uint64_t phase) const {
+    auto p = (phase >> (32 - phase_bits)) & ((size_t(1) << phase_bits) - 1);
+    return coefficients.data() + p * taps * channels;
+  }
+};
+
+// how a voice plays: the gain of each side, frames to fade in from the
+// start and out to the end, and how many more times to go round (-1 for
+// ever); channels other than the right of a stereo pair take gain_left
+struct playback_params {
+  float gain_left = 1;
+  float gain_right = 1;
+  Uint32 fade_in_frames = 0;
+  Uint32 fade_out_frames = 0;
+  int loops = 0;
+  int bus = 0; // index in the bus_graph, 0 the master
+};
+
+// a biquad filter in transposed direct form II, normalised so a0 is 1
+struct biquad {
+  float b0 = 1, b1 = 0, b2 = 0, a1 = 0, a2 = 0;
+};
+
+// the RBJ audio EQ cookbook filters: lowpass, highpass, bandpass,
+// peaking, lowshelf and highshelf; false for an unknown type
+bool design_biquad(std::string const &type, double frequency, double q,
+                   double gain_db, int rate, biquad &filter) {
+  double a = std::pow(10, gain_db / 40);
+  double w0 = 2 * M_PI * frequency / rate;
+  double cos_w0 = std::cos(w0);
+  double alpha = std::sin(w0) / (2 * q);
+  double shelf = 2 * std::sqrt(a) * alpha;
+  double b0, b1, b2, a0, a1, a2;
+  if ("lowpass" == type) {
+    b0 = b2 = (1 - cos_w0) / 2;
+    b1 = 1 - cos_w0;
+    a0 = 1 + alpha, a1 = -2 * cos_w0, a2 = 1 - alpha;
+  } else if ("highpass" == type) {
+    b0 = b2 = (1 + cos_w0) / 2;
+    b1 = -(1 + cos_w0);
+    a0 = 1 + alpha, a1 = -2 * cos_w0, a2 = 1 - alpha;
+  } else if ("bandpass" == type) {
+    b0 = alpha, b1 = 0, b2 = -alpha;
+    a0 = 1 + alpha, a1 = -2 * cos_w0, a2 = 1 - alpha;
+  } else if ("peaking" == type) {
+    b0 = 1 + alpha * a, b1 = -2 * cos_w0, b2 = 1 - alpha * a;
+    a0 = 1 + alpha / a, a1 = -2 * cos_w0, a2 = 1 - alpha / a;
+  } else if ("lowshelf" == type) {
+    b0 = a * ((a + 1) - (a - 1) * cos_w0 + shelf);
+    b1 = 2 * a * ((a - 1) - (a + 1) * cos_w0);
+    b2 = a * ((a + 1) - (a - 1) * cos_w0 - shelf);
+    a0 = (a + 1) + (a - 1) * cos_w0 + shelf;
+    a1 = -2 * ((a - 1) + (a + 1) * cos_w0);
+    a2 = (a + 1) + (a - 1) * cos_w0 - shelf;
+  } else if ("highshelf" == type) {
+    b0 = a * ((a + 1) + (a - 1) * cos_w0 + shelf);
+    b1 = -2 * a * ((a - 1) + (a + 1) * cos_w0);
+    b2 = a * ((a + 1) + (a - 1) * cos_w0 - shelf);
+    a0 = (a + 1) - (a - 1) * cos_w0 + shelf;
+    a1 = 2 * ((a - 1) - (a + 1) * cos_w0);
+    a2 = (a + 1) - (a - 1) * cos_w0 - shelf;
+  } else {
+    return false;
+  }
+  filter = {float(b0 / a0), float(b1 / a0), float(b2 / a0), float(a1 / a0),
+            float(a2 / a0)};
+  return true;
+}
+
+// one bus of a bus_graph, in the mixer's terms
+struct mix_bus {
+  bool bus_present = false;
+  int bus_parent = -1; // -1 for the output
+  float bus_gain = 1;
+  bool bus_filtered = false;
+  biquad bus_eq;
+  std::vector<std::pair<int, float>> bus_sends; // bus and level
+  // compression is off at ratio 1; attack and release are envelope
+  // coefficients per compressor step
+  float compress_threshold = 1;
+  float compress_ratio = 1;
+  float compress_attack = 1;
+  float compress_release = 1;
+  float compress_makeup = 1;
+};
+
+// a bus as set over HTTP, compiled into a mix_bus by publish_buses
+struct bus_settings {
+  std::string parent = "master";
+  float gain = 1;
+  std::string eq = "none";
+  float eq_freq = 1000;
+  float eq_q = 0.707f;
+  float eq_gain_db = 0;
+  std::vector<std::pair<std::string, float>> sends;
+  float compress_threshold_db = 0;
+  float compress_ratio = 1;
+  float compress_attack_ms = 5;
+  float compress_release_ms = 100;
+  float makeup_db = 0;
+};
+
+// A compiled set of buses, indexed by bus number with 0 the master, and
+// the order to run them in so every bus is done before those it feeds.
+// Never changed once handed to the mixer; a new one replaces it whole.
+struct bus_graph {
+  uint64_t graph_generation = 0;
+  std::vector<mix_bus> buses;
+  std::vector<int> bus_order;
+};
+
+struct mixer_command {
+  enum command_type { play_voice, stop_voice, chain_voice, set_voice } type;
+  int voice;
+  sequence_t sequence;
+  Mix_Chunk *chunk;
+  uint64_t start_frame;
+  // chain_voice: the voice to follow on the sample it ends
+  int after_voice;
+  sequence_t after_sequence;
+  // stop_voice: frames to fade out over rather than stopping dead
+  Uint32 fade_frames;
+  // play_voice, chain_voice: source frames per output frame in 32.32
+  // fixed point, and the filter to resample with, null to mix directly
+  uint64_t step;
+  resampler_table const *table;
+  // play_voice, chain_voice, set_voice
+  playback_params params;
+  // play_voice: when the request for it arrived and when it was started,
+  // for trigger_latency; 0 when not timed
+  int64_t received_nanos;
+  int64_t started_nanos;
+};
+
+// Wakes the libevent thread through an eventfd, or a pipe where there
+// is none, once the audio callback has posted completions. The callback
+// only pushes to its wait-free ring; a thread of its own looks at the
+// ring every period and does the write. While nothing plays it waits
+// instead, for the libevent thread to say something does, so an idle
+// server does not wake at all.
+struct completion_signal {
+  int fds[2] = {-1, -1}; // an eventfd is both ends
+  std::atomic<bool> pending{false};
+  std::mutex busy_mutex;
+  std::condition_variable busy_changed;
+  bool busy = false;     // under busy_mutex
+  bool stopping = false; // under busy_mutex
+  std::thread watcher;
+
+  ~completion_signal() {
+    {
+      std::lock_guard<std::mutex> lock(busy_mutex);
+      stopping = true;
+    }
+    busy_changed.notify_one();
+    if (watcher.joinable()) {
+      watcher.join();
+    }
+    for (auto fd : {fds[0], fds[1] != fds[0] ? fds[1] : -1}) {
+      if (fd >= 0) {
+        close(fd);
+      }
+    }
+  }
+
+  // posted says whether the callback has left anything to drain
+  template <typename F>
+  bool open(std::chrono::microseconds period, F posted) {
+#ifdef __linux__
+    fds[0] = fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fds[0] < 0) {
+      log_error("eventfd {}", std::strerror(errno));
+      return false;
+    }
+#else
+    if (pipe(fds) || evutil_make_socket_nonblocking(fds[0]) ||
+        evutil_make_socket_nonblocking(fds[1])) {
+      log_error("pipe {}", std::strerror(errno));
+      return false;
+    }
+#endif
+    watcher = std::thread([this, period, posted] {
+      for (;;) {
+        {
+          std::unique_lock<std::mutex> lock(busy_mutex);
+          busy_changed.wait(lock, [this] { return busy || stopping; });
+          if (stopping) {
+            return;
+          }
+        }
+        std::this_thread::sleep_for(period);
+        if (posted()) {
+          notify();
+        }
+      }
+    });
+    return true;
+  }
+
+  // libevent thread: whether anything plays that will post a completion
+  void set_busy(bool now_busy) {
+    {
+      std::lock_guard<std::mutex> lock(busy_mutex);
+      if (busy == now_busy) {
+        return;
+      }
+      busy = now_busy;
+    }
+    busy_changed.notify_one();
+  }
+
+  void notify() {
+    if (pending.exchange(true)) {
+      return;
+    }
+    uint64_t one = 1;
+    if (write(fds[1], &one, sizeof(one)) < 0) {
+      log_error("completion signal write {}", std::strerror(errno));
+    }
+  }
+
+  // before draining, so a completion posted meanwhile signals again
+  void clear() {
+    uint64_t signals;
+    while (read(fds[0], &signals, sizeof(signals)) > 0) {
+    }
+    pending = false;
+  }
+};
+
+struct mixer_completion {
+  int voice;
+  sequence_t sequence;
+  bool late;          // scheduled for a frame that had already been mixed
+  uint64_t end_frame; // the output frame after its last
+};
+
+// Mixing kernels: mix adds gain * src into a float accumulator and
+// saturate converts the accumulator to AUDIO_S16SYS once per buffer.
+void mix_s16_scalar(float *acc, Sint16 const *src, size_t count, float gain) {
+  for (size_t i = 0; count > i; ++i) {
+    acc[i] += src[i] * gain;
+  }
+}
+
+void saturate_s16_scalar(Sint16 *out, float const *acc, size_t count) {
+  for (size_t i = 0; count > i; ++i) {
+    auto clamped = std::max(-32768.f, std::min(32767.f, acc[i]));
+    out[i] = Sint16(std::lrint(clamped));
+  }
+}
+
+// Resampling kernels add gain * src resampled into frames output frames of
+// acc, starting at source frame phase >> 32 and advancing phase by step
+// each frame. The caller keeps every tap of those frames inside src.
+void resample_s16_scalar(float *acc, size_t frames, Sint16 const *src,
+                         uint64_t &phase, uint64_t step,
+                         resampler_table const &table, float gain) {
+  auto taps = table.taps;
+  auto channels = table.channels;
+  for (size_t f = 0; frames > f; ++f, phase += step) {
+    auto coefficients = table.row(phase);
+    auto base = src + (int64_t(phase >> 32) - taps / 2 + 1) * channels;
+    for (int c = 0; channels > c; ++c) {
+      float sum = 0;
+      for (int t = 0; taps > t; ++t) {
+        sum += coefficients[t * channels + c] * base[t * channels + c];
+      }
+      acc[f * channels + c] += gain * sum;
+    }
+  }
+}
+
+// Ramp kernels add src into acc over frames frames, at a gain for each
+// channel starting from gain[c] and moving by delta[c] a frame; src is
+// either the 16 bit samples or a frame buffer already resampled.
+template <typename T>
+void ramp_scalar(float *acc, T const *src, size_t frames, int channels,
+                 float const *gain, float const *delta) {
+  for (size_t f = 0; frames > f; ++f) {
+    for (int c = 0; channels > c; ++c) {
+      acc[f * channels + c] +=
+          (gain[c] + f * delta[c]) * src[f * channels + c];
+    }
+  }
+}
+
+// the largest magnitude in src, for the compressor's level detection
+float peak_f32_scalar(float const *src, size_t count) {
+  float peak = 0;
+  for (size_t i = 0; count > i; ++i) {
+    peak = std::max(peak, std::abs(src[i]));
+  }
+  return peak;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2"))) void
+mix_s16_sse2(float *acc, Sint16 const *src, size_t count, float gain) {
+  auto g = _mm_set1_ps(gain);
+  size_t i = 0;
+  for (; count >= i + 8; i += 8) {
+    auto s = _mm_loadu_si128(reinterpret_cast<__m128i const *>(src + i));
+    auto lo = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(s, s), 16));
+    auto hi = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(s, s), 16));
+    _mm_storeu_ps(acc + i, _mm_add_ps(_mm_loadu_ps(acc + i), _mm_mul_ps(lo, g)));
+    _mm_storeu_ps(acc + i + 4,
+                  _mm_add_ps(_mm_loadu_ps(acc + i + 4), _mm_mul_ps(hi, g)));
+  }
+  mix_s16_scalar(acc + i, src + i, count - i, gain);
+}
+
+__attribute__((target("sse2"))) void
+saturate_s16_sse2(Sint16 *out, float const *acc, size_t count) {
+  auto lowest = _mm_set1_ps(-32768.f);
+  auto highest = _mm_set1_ps(32767.f);
+  size_t i = 0;
+  for (; count >= i + 8; i += 8) {
+    auto lo = _mm_min_ps(highest, _mm_max_ps(lowest, _mm_loadu_ps(acc + i)));
+    auto hi =
+        _mm_min_ps(highest, _mm_max_ps(lowest, _mm_loadu_ps(acc + i + 4)));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i),
+                     _mm_packs_epi32(_mm_cvtps_epi32(lo), _mm_cvtps_epi32(hi)));
+  }
+  saturate_s16_scalar(out + i, acc + i, count - i);
+}
+
+__attribute__((target("sse2"))) float peak_f32_sse2(float const *src,
+                                                    size_t count) {
+  auto magnitude = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+  auto peak = _mm_setzero_ps();
+  size_t i = 0;
+  for (; count >= i + 4; i += 4) {
+    peak = _mm_max_ps(peak, _mm_and_ps(magnitude, _mm_loadu_ps(src + i)));
+  }
+  peak = _mm_max_ps(peak, _mm_movehl_ps(peak, peak));
+  peak = _mm_max_ss(peak, _mm_shuffle_ps(peak, peak, 1));
+  return std::max(_mm_cvtss_f32(peak), peak_f32_scalar(src + i, count - i));
+}
+
+__attribute__((target("sse2"))) inline __m128 load_ps_sse2(Sint16 const *src) {
+  auto s = _mm_loadl_epi64(reinterpret_cast<__m128i const *>(src));
+  return _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(s, s), 16));
+}
+
+__attribute__((target("sse2"))) inline __m128 load_ps_sse2(float const *src) {
+  return _mm_loadu_ps(src);
+}
+
+// lane l of the vector ramps carries channel l % channels of frame
+// l / channels, so they need the width to be a multiple of channels
+template <typename T>
+__attribute__((target("sse2"))) void
+ramp_sse2(float *acc, T const *src, size_t frames, int channels,
+          float const *gain, float const *delta) {
+  if (4 % channels) {
+    ramp_scalar(acc, src, frames, channels, gain, delta);
+    return;
+  }
+  float lane_gain[4], lane_delta[4];
+  for (int l = 0; 4 > l; ++l) {
+    lane_gain[l] = gain[l % channels] + l / channels * delta[l % channels];
+    lane_delta[l] = 4 / channels * delta[l % channels];
+  }
+  auto g = _mm_loadu_ps(lane_gain);
+  auto d = _mm_loadu_ps(lane_delta);
+  size_t count = frames * channels;
+  size_t i = 0;
+  for (size_t k = 0; count >= i + 4; i += 4, ++k) {
+    auto lane = _mm_add_ps(g, _mm_mul_ps(_mm_set1_ps(float(k)), d));
+    _mm_storeu_ps(acc + i, _mm_add_ps(_mm_loadu_ps(acc + i),
+                                      _mm_mul_ps(load_ps_sse2(src + i), lane)));
+  }
+  float rest_gain[4];
+  size_t done = i / channels;
+  for (int c = 0; channels > c; ++c) {
+    rest_gain[c] = gain[c] + done * delta[c];
+  }
+  ramp_scalar(acc + i, src + i, frames - done, channels, rest_gain, delta);
+}
+
+// the vector kernels take whole rows a register at a time, so they need
+// the row length to be a multiple of the width and each lane to belong to
+// one channel throughout; the lanes are then folded down to a frame
+__attribute__((target("sse2"))) inline void
+add_folded_frame_sse2(float *acc, __m128 sum, int channels, float gain) {
+  if (channels < 4) {
+    sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+  }
+  if (channels < 2) {
+    sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+  }
+  float lanes[4];
+  _mm_storeu_ps(lanes, sum);
+  for (int c = 0; channels > c; ++c) {
+    acc[c] += gain * lanes[c];
+  }
+}
+
+__attribute__((target("sse2"))) void
+resample_s16_sse2(float *acc, size_t frames, Sint16 const *src,
+                  uint64_t &phase, uint64_t step, resampler_table const &table,
+                  float gain) {
+  auto channels = table.channels;
+  size_t row_length = table.taps * channels;
+  if (row_length % 4 || 4 % channels) {
+    resample_s16_scalar(acc, frames, src, phase, step, table, gain);
+    return;
+  }
+  for (size_t f = 0; frames > f; ++f, phase += step) {
+    auto coefficients = table.row(phase);
+    auto base = src + (int64_t(phase >> 32) - table.taps / 2 + 1) * channels;
+    auto sum = _mm_setzero_ps();
+    for (size_t i = 0; row_length > i; i += 4) {
+      auto s = _mm_loadl_epi64(reinterpret_cast<__m128i const *>(base + i));
+      auto v = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(s, s), 16));
+      sum = _mm_add_ps(sum, _mm_mul_ps(v, _mm_loadu_ps(coefficients + i)));
+    }
+    add_folded_frame_sse2(acc + f * channels, sum, channels, gain);
+  }
+}
+
+__attribute__((target("avx2"))) void
+mix_s16_avx2(float *acc, Sint16 const *src, size_t count, float gain) {
+  auto g = _mm256_set1_ps(gain);
+  size_t i = 0;
+  for (; count >= i + 16; i += 16) {
+    auto s = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(src + i));
+    auto lo = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm256_castsi256_si128(s)));
+    auto hi =
+        _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm256_extracti128_si256(s, 1)));
+    _mm256_storeu_ps(acc + i, _mm256_add_ps(_mm256_loadu_ps(acc + i),
+                                            _mm256_mul_ps(lo, g)));
+    _mm256_storeu_ps(acc + i + 8, _mm256_add_ps(_mm256_loadu_ps(acc + i + 8),
+                                                _mm256_mul_ps(hi, g)));
+  }
+  mix_s16_sse2(acc + i, src + i, count - i, gain);
+}
+
+__attribute__((target("avx2"))) void
+saturate_s16_avx2(Sint16 *out, float const *acc, size_t count) {
+  auto lowest = _mm256_set1_ps(-32768.f);
+  auto highest = _mm256_set1_ps(32767.f);
+  size_t i = 0;
+  for (; count >= i + 16; i += 16) {
+    auto lo = _mm256_min_ps(highest,
+                            _mm256_max_ps(lowest, _mm256_loadu_ps(acc + i)));
+    auto hi = _mm256_min_ps(
+        highest, _mm256_max_ps(lowest, _mm256_loadu_ps(acc + i + 8)));
+    // packs works within each 128 bit lane, so put the quads back in order
+    auto packed = _mm256_packs_epi32(_mm256_cvtps_epi32(lo),
+                                     _mm256_cvtps_epi32(hi));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i),
+                        _mm256_permute4x64_epi64(packed, 0xd8));
+  }
+  saturate_s16_sse2(out + i, acc + i, count - i);
+}
+
+__attribute__((target("avx2"))) float peak_f32_avx2(float const *src,
+                                                    size_t count) {
+  auto magnitude = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+  auto peak = _mm256_setzero_ps();
+  size_t i = 0;
+  for (; count >= i + 8; i += 8) {
+    peak = _mm256_max_ps(peak,
+                         _mm256_and_ps(magnitude, _mm256_loadu_ps(src + i)));
+  }
+  float lanes[8];
+  _mm256_storeu_ps(lanes, peak);
+  return std::max(*std::max_element(lanes, lanes + 8),
+                  peak_f32_sse2(src + i, count - i));
+}
+
+__attribute__((target("avx2"))) inline __m256 load_ps_avx2(Sint16 const *src) {
+  return _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(
+      _mm_loadu_si128(reinterpret_cast<__m128i const *>(src))));
+}
+
+__attribute__((target("avx2"))) inline __m256 load_ps_avx2(float const *src) {
+  return _mm256_loadu_ps(src);
+}
+
+template <typename T>
+__attribute__((target("avx2"))) void
+ramp_avx2(float *acc, T const *src, size_t frames, int channels,
+          float const *gain, float const *delta) {
+  if (8 % channels) {
+    ramp_sse2(acc, src, frames, channels, gain, delta);
+    return;
+  }
+  float lane_gain[8], lane_delta[8];
+  for (int l = 0; 8 > l; ++l) {
+    lane_gain[l] = gain[l % channels] + l / channels * delta[l % channels];
+    lane_delta[l] = 8 / channels * delta[l % channels];
+  }
+  auto g = _mm256_loadu_ps(lane_gain);
+  auto d = _mm256_loadu_ps(lane_delta);
+  size_t count = frames * channels;
+  size_t i = 0;
+  for (size_t k = 0; count >= i + 8; i += 8, ++k) {
+    auto lane = _mm256_add_ps(g, _mm256_mul_ps(_mm256_set1_ps(float(k)), d));
+    _mm256_storeu_ps(acc + i,
+                     _mm256_add_ps(_mm256_loadu_ps(acc + i),
+                                   _mm256_mul_ps(load_ps_avx2(src + i), lane)));
+  }
+  float rest_gain[8];
+  size_t done = i / channels;
+  for (int c = 0; channels > c; ++c) {
+    rest_gain[c] = gain[c] + done * delta[c];
+  }
+  ramp_sse2(acc + i, src + i, frames - done, channels, rest_gain, delta);
+}
+
+__attribute__((target("avx2"))) void
+resample_s16_avx2(float *acc, size_t frames, Sint16 const *src,
+                  uint64_t &phase, uint64_t step, resampler_table const &table,
+                  float gain) {
+  auto channels = table.channels;
+  size_t row_length = table.taps * channels;
+  if (row_length % 8 || 8 % channels) {
+    resample_s16_sse2(acc, frames, src, phase, step, table, gain);
+    return;
+  }
+  for (size_t f = 0; frames > f; ++f, phase += step) {
+    auto coefficients = table.row(phase);
+    auto base = src + (int64_t(phase >> 32) - table.taps / 2 + 1) * channels;
+    auto sum = _mm256_setzero_ps();
+    for (size_t i = 0; row_length > i; i += 8) {
+      auto s = _mm_loadu_si128(reinterpret_cast<__m128i const *>(base + i));
+      auto v = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(s));
+      sum = _mm256_add_ps(sum,
+                          _mm256_mul_ps(v, _mm256_loadu_ps(coefficients + i)));
+    }
+    if (channels == 8) {
+      _mm256_storeu_ps(acc + f * channels,
+                       _mm256_add_ps(_mm256_loadu_ps(acc + f * channels),
+                                     _mm256_mul_ps(sum, _mm256_set1_ps(gain))));
+      continue;
+    }
+    add_folded_frame_sse2(acc + f * channels,
+                          _mm_add_ps(_mm256_castps256_ps128(sum),
+                                     _mm256_extractf128_ps(sum, 1)),
+                          channels, gain);
+  }
+}
+#endif
+
+struct mix_kernels {
+  char const *kernels_name;
+  void (*mix)(float *acc, Sint16 const *src, size_t count, float gain);
+  void (*saturate)(Sint16 *out, float const *acc, size_t count);
+  void (*resample)(float *acc, size_t frames, Sint16 const *src,
+                   uint64_t &phase, uint64_t step,
+                   resampler_table const &table, float gain);
+  void (*ramp_s16)(float *acc, Sint16 const *src, size_t frames, int channels,
+                   float const *gain, float const *delta);
+  void (*ramp_f32)(float *acc, float const *src, size_t frames, int channels,
+                   float const *gain, float const *delta);
+  float (*peak)(float const *src, size_t count);
+};
+
+std::vector<mix_kernels> available_mix_kernels() {
+  std::vector<mix_kernels> ret{
+      {"scalar", mix_s16_scalar, saturate_s16_scalar, resample_s16_scalar,
+       ramp_scalar<Sint16>, ramp_scalar<float>, peak_f32_scalar}};
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2")) {
+    ret.push_back(
+        {"sse2", mix_s16_sse2, saturate_s16_sse2, resample_s16_sse2,
+         ramp_sse2<Sint16>, ramp_sse2<float>, peak_f32_sse2});
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    ret.push_back(
+        {"avx2", mix_s16_avx2, saturate_s16_avx2, resample_s16_avx2,
+         ramp_avx2<Sint16>, ramp_avx2<float>, peak_f32_avx2});
+  }
+#endif
+  return ret;
+}
+
+// the last available set is the widest
+mix_kernels const &best_mix_kernels() {
+  static auto const kernels = available_mix_kernels().back();
+  return kernels;
+}
+
+struct mixer_voice {
+  Mix_Chunk *voice_chunk = nullptr;
+  Uint32 voice_position = 0;
+  sequence_t voice_sequence = 0;
+  // while voice_scheduled the voice waits in the wheel for its frame
+  uint64_t voice_start_frame = 0;
+  bool voice_scheduled = false;
+  int next_scheduled = -1;
+  // samples into the current buffer before the voice starts
+  size_t voice_offset = 0;
+  // a chain of voices each starting where the one before ends; while
+  // voice_waiting the voice is in a chain behind previous_voice
+  int next_voice = -1;
+  int previous_voice = -1;
+  bool voice_waiting = false;
+  uint64_t voice_block = 0; // last block mixed, so chains mix once each
+  // a stopped voice ramps down to silence over voice_fade_total frames
+  Uint32 voice_fade_total = 0;
+  Uint32 voice_fade_left = 0;
+  // voice_left and voice_right are the gains now, which ramp to those in
+  // voice_params over voice_ramp_left frames after a set_voice
+  playback_params voice_params;
+  float voice_left = 1;
+  float voice_right = 1;
+  Uint32 voice_ramp_left = 0;
+  uint64_t voice_played = 0; // output frames, for fading in
+  // a voice with a voice_table is resampled: voice_phase is the source
+  // frame in 32.32 fixed point, advancing voice_step each output frame
+  resampler_table const *voice_table = nullptr;
+  uint64_t voice_phase = 0;
+  uint64_t voice_step = 0;
+};
+
+// In-house replacement for SDL_mixer channels, run from Mix_SetPostMix.
+// The control (libevent) thread owns voice allocation and the audio
+// thread owns playback; they only talk through the two rings. A voice
+// is handed out again only after its completion has been drained, so
+// at most one completion per voice is ever in flight.
+struct mixer_engine {
+  // scheduled voices are bucketed by start frame, one buffer's worth of
+  // frames per bucket, so each callback only looks at the voices due in
+  // it; voices further ahead than the wheel go round again
+  static size_t const wheel_buckets = 1024;
+  static uint64_t const unity_step = uint64_t(1) << 32;
+  static int const max_channels = 8;
+  static int const max_buses = 32;
+  static constexpr size_t compressor_frames = 32;
+
+  // filter and compressor memory of a bus, kept across graph changes
+  struct bus_state {
+    float state_z1[max_channels] = {};
+    float state_z2[max_channels] = {};
+    float state_gain = 1; // gain at the end of the last block, to ramp from
+    float state_envelope = 0;
+    // the same for each send, by the bus sent to
+    float state_sends[max_buses] = {};
+  };
+
+  spsc_ring<mixer_command> commands;       // control -> audio
+  spsc_ring<mixer_completion> completions; // audio -> control
+  std::vector<int> free_voices;            // control thread only
+  std::vector<mixer_voice> voices;         // audio thread only
+  std::vector<float> accumulator;          // audio thread only
+  std::vector<float> resampled;            // audio thread only
+  mix_kernels kernels = best_mix_kernels();
+  int const frequency;
+  int const channels;
+
+  std::vector<int> wheel;    // audio thread only
+  uint64_t frames_mixed = 0; // audio thread only
+  uint64_t blocks_mixed = 1; // audio thread only
+  // published at the end of each callback for frame_for_time
+  std::atomic<uint64_t> published_frames{0};
+  std::atomic<int64_t> stream_epoch_micros{0}; // wall clock at frame 0
+  // frame 0 is time 0 and the clock runs exactly at frequency, for
+  // rendering offline faster than real time
+  bool virtual_clock = false;
+  trigger_latency *latency = nullptr; // voices started by requests
+  int64_t callback_nanos = 0;         // audio thread only
+  int64_t last_callback_nanos = 0;    // audio thread only
+  latency_histogram callback_duration;
+  // filters by quantized cutoff, built on the control thread the first
+  // time a rate needs one and kept, as voices may hold them any time
+  int resampler_taps = 16;
+  std::unordered_map<int, std::unique_ptr<resampler_table>> tables;
+  // the bus graph is swapped in whole through graph; graphs holds it and
+  // any before it the audio thread may still be running, until graph_seen
+  // shows it has moved on. Without a graph voices go to the output.
+  std::atomic<bus_graph const *> graph{nullptr};
+  std::atomic<uint64_t> graph_seen{0};
+  std::vector<std::unique_ptr<bus_graph>> graphs; // control thread only
+  bus_graph const *graph_now = nullptr;           // audio thread only
+  std::vector<float> bus_buffers;                 // audio thread only
+  std::vector<bus_state> bus_states;              // audio thread only
+
+  mixer_engine(int voice_count, int frequency_, int channels_,
+               size_t frames_per_callback)
+      : commands(4 * voice_count), completions(voice_count),
+        voices(voice_count), accumulator(frames_per_callback * channels_),
+        resampled(accumulator.size()),
+        frequency(frequency_), channels(channels_), wheel(wheel_buckets, -1),
+        bus_buffers(max_buses * accumulator.size()), bus_states(max_buses) {
+    for (int voice = voice_count; voice--;) {
+      free_voices.push_back(voice);
+    }
+  }
+
+  size_t bucket_frames() const { return accumulator.size() / channels; }
+
+  // null for unity_step, which is mixed directly. Downsampling lowers the
+  // cutoff to the output Nyquist frequency, in 1/64 steps to bound the
+  // number of tables.
+  resampler_table const *table_for(uint64_t step) {
+    if (step == unity_step) {
+      return nullptr;
+    }
+    int key = 64;
+    if (step > unity_step) {
+      key = std::max(1, int(64 * unity_step / step));
+    }
+    auto &table = tables[key];
+    if (!table) {
+      table = std::make_unique<resampler_table>(resampler_taps, channels,
+                                                key / 64.);
+    }
+    return table.get();
+  }
+
+  // start_frame 0 starts the voice in the next buffer mixed; step plays
+  // it at another rate, see mixer_command
+  int start_voice(Mix_Chunk *chunk, sequence_t sequence,
+                  uint64_t start_frame = 0, uint64_t step = unity_step,
+                  playback_params const &params = {},
+                  int64_t received_nanos = 0) {
+    if (free_voices.empty()) {
+      return -1;
+    }
+    auto voice = free_voices.back();
+    if (!commands.push({mixer_command::play_voice, voice, sequence, chunk,
+                        start_frame, -1, 0, 0, step, table_for(step), params,
+                        received_nanos,
+                        received_nanos ? now_nanos() : 0})) {
+      return -1;
+    }
+    free_voices.pop_back();
+    return voice;
+  }
+
+  // starts chunk on the sample after_voice ends, or straight away if it
+  // has already ended by the time the audio thread sees the command
+  int chain_voice(Mix_Chunk *chunk, sequence_t sequence, int after_voice,
+                  sequence_t after_sequence, uint64_t step = unity_step,
+                  playback_params const &params = {}) {
+    if (free_voices.empty()) {
+      return -1;
+    }
+    auto voice = free_voices.back();
+    if (!commands.push({mixer_command::chain_voice, voice, sequence, chunk, 0,
+                        after_voice, after_sequence, 0, step, table_for(step),
+                        params})) {
+      return -1;
+    }
+    free_voices.pop_back();
+    return voice;
+  }
+
+  bool stop_voice(int voice, sequence_t sequence, Uint32 fade_frames = 0) {
+    return commands.push({mixer_command::stop_voice, voice, sequence, nullptr,
+                          0, -1, 0, fade_frames});
+  }
+
+  // changes the rate, gains, loops and fade out of a playing voice; the
+  // gains ramp over a few milliseconds so the change doesn't click
+  bool set_voice(int voice, sequence_t sequence, uint64_t step,
+                 playback_params const &params) {
+    return commands.push({mixer_command::set_voice, voice, sequence, nullptr,
+                          0, -1, 0, 0, step, table_for(step), params});
+  }
+
+  // maps a wall clock time, as in the TIME line, to the output frame
+  // played then. Anything within a buffer of what is already mixed is
+  // too late to be sure the command arrives in time; late_micros says
+  // by how much.
+  bool frame_for_time(int64_t micros, uint64_t &frame,
+                      int64_t &late_micros) const {
+    auto mixed = published_frames.load(std::memory_order_acquire);
+    auto epoch = stream_epoch_micros.load(std::memory_order_acquire);
+    int64_t earliest = mixed + bucket_frames();
+    int64_t target = (micros - epoch) * frequency / 1000000;
+    if ((!mixed && !virtual_clock) || target < earliest) {
+      late_micros = mixed ? (earliest - target) * 1000000 / frequency : 0;
+      return false;
+    }
+    frame = target;
+    return true;
+  }
+
+  // the wall clock time frame is heard, a callback after it is mixed
+  int64_t micros_for_frame(uint64_t frame) const {
+    return stream_epoch_micros.load(std::memory_order_acquire) +
+           int64_t(frame + bucket_frames()) * 1000000 / frequency;
+  }
+
+  template <typename F> void drain_completions(F &&on_completion) {
+    mixer_completion completion;
+    while (completions.pop(completion)) {
+      free_voices.push_back(completion.voice);
+      on_completion(completion);
+    }
+    free_old_graphs();
+  }
+
+  // the audio thread runs next from its next callback
+  void set_graph(std::unique_ptr<bus_graph> next) {
+    next->graph_generation =
+        graphs.empty() ? 1 : graphs.back()->graph_generation + 1;
+    graph.store(next.get(), std::memory_order_release);
+    graphs.push_back(std::move(next));
+    free_old_graphs();
+  }
+
+  void free_old_graphs() {
+    auto seen = graph_seen.load(std::memory_order_acquire);
+    while (graphs.size() > 1 && seen >= graphs[1]->graph_generation) {
+      graphs.erase(graphs.begin());
+    }
+  }
+
+  // a finished voice hands its place in a chain to its successor, which
+  // starts at the beginning of the next block mixed unless mix_voice
+  // gives it an exact offset
+  void finish_voice(int voice, uint64_t end_frame, bool late = false) {
+    auto &v = voices[voice];
+    if (v.voice_waiting) {
+      voices[v.previous_voice].next_voice = v.next_voice;
+      if (v.next_voice >= 0) {
+        voices[v.next_voice].previous_voice = v.previous_voice;
+      }
+    } else if (v.next_voice >= 0) {
+      auto &next = voices[v.next_voice];
+      next.voice_waiting = false;
+      next.previous_voice = -1;
+    }
+    completions.push({voice, v.voice_sequence, late, end_frame});
+    v = mixer_voice{};
+  }
+
+  void schedule_voice(int voice) {
+    auto &v = voices[voice];
+    auto &head = wheel[(v.voice_start_frame / bucket_frames()) % wheel_buckets];
+    v.voice_scheduled = true;
+    v.next_scheduled = head;
+    head = voice;
+  }
+
+  void unschedule_voice(int voice) {
+    auto &v = voices[voice];
+    auto link =
+        &wheel[(v.voice_start_frame / bucket_frames()) % wheel_buckets];
+    while (*link >= 0 && *link != voice) {
+      link = &voices[*link].next_scheduled;
+    }
+    if (*link == voice) {
+      *link = v.next_scheduled;
+    }
+    v.voice_scheduled = false;
+    v.next_scheduled = -1;
+  }
+
+  // moves the voices due within the next frames to playing, each
+  // offset to its exact sample in the buffer
+  void start_due_voices(size_t frames) {
+    auto end = frames_mixed + frames;
+    for (auto bucket = frames_mixed / bucket_frames();
+         (end - 1) / bucket_frames() >= bucket; ++bucket) {
+      auto link = &wheel[bucket % wheel_buckets];
+      while (*link >= 0) {
+        auto voice = *link;
+        auto &v = voices[voice];
+        if (v.voice_start_frame >= end) {
+          link = &v.next_scheduled;
+          continue;
+        }
+        *link = v.next_scheduled;
+        v.voice_scheduled = false;
+        v.next_scheduled = -1;
+        v.voice_offset = (v.voice_start_frame - frames_mixed) * channels;
+      }
+    }
+  }
+
+  void apply_commands() {
+    mixer_command command;
+    while (commands.pop(command)) {
+      auto &v = voices[command.voice];
+      switch (command.type) {
+      case mixer_command::play_voice:
+        v.voice_chunk = command.chunk;
+        v.voice_position = 0;
+        v.voice_sequence = command.sequence;
+        v.voice_table = command.table;
+        v.voice_step = command.step;
+        start_params(v, command.params);
+        // a voice starting straight away is mixed from the top of this
+        // callback
+        if (latency && command.received_nanos && !command.start_frame) {
+          latency->start_to_callback.record(callback_nanos -
+                                            command.started_nanos);
+          latency->receive_to_callback.record(callback_nanos -
+                                              command.received_nanos);
+        }
+        if (command.start_frame) {
+          v.voice_start_frame = command.start_frame;
+          if (command.start_frame < frames_mixed) {
+            finish_voice(command.voice, frames_mixed, true);
+          } else {
+            schedule_voice(command.voice);
+          }
+        }
+        break;
+      case mixer_command::chain_voice: {
+        v.voice_chunk = command.chunk;
+        v.voice_position = 0;
+        v.voice_sequence = command.sequence;
+        v.voice_table = command.table;
+        v.voice_step = command.step;
+        start_params(v, command.params);
+        auto &after = voices[command.after_voice];
+        if (after.voice_chunk && after.voice_sequence == command.after_sequence &&
+            after.next_voice < 0) {
+          after.next_voice = command.voice;
+          v.previous_voice = command.after_voice;
+          v.voice_waiting = true;
+        }
+        break;
+      }
+      case mixer_command::stop_voice:
+        if (v.voice_chunk && v.voice_sequence == command.sequence) {
+          if (command.fade_frames && !v.voice_scheduled && !v.voice_waiting) {
+            v.voice_fade_total = v.voice_fade_left = command.fade_frames;
+            break;
+          }
+          if (v.voice_scheduled) {
+            unschedule_voice(command.voice);
+          }
+          finish_voice(command.voice, frames_mixed);
+        }
+        break;
+      case mixer_command::set_voice:
+        if (v.voice_chunk && v.voice_sequence == command.sequence) {
+          auto fade_in_frames = v.voice_params.fade_in_frames;
+          v.voice_params = command.params;
+          v.voice_params.fade_in_frames = fade_in_frames;
+          v.voice_ramp_left = std::max(1, frequency / 200);
+          if (command.table && !v.voice_table) {
+            v.voice_phase = uint64_t(v.voice_position / channels) << 32;
+          } else if (!command.table && v.voice_table) {
+            v.voice_position = (v.voice_phase >> 32) * channels;
+          }
+          v.voice_table = command.table;
+          v.voice_step = command.step;
+        }
+        break;
+      }
+    }
+  }
+
+  void start_params(mixer_voice &v, playback_params const &params) {
+    v.voice_params = params;
+    v.voice_left = params.gain_left;
+    v.voice_right = params.gain_right;
+  }
+
+  // output frames before voice reaches the end of its chunk
+  uint64_t frames_to_end(mixer_voice const &v) const {
+    auto total = v.voice_chunk->alen / sizeof(Sint16);
+    if (!v.voice_table) {
+      return (total - v.voice_position) / channels;
+    }
+    auto end = uint64_t(total / channels) << 32;
+    return end > v.voice_phase
+               ? (end - v.voice_phase + v.voice_step - 1) / v.voice_step
+               : 0;
+  }
+
+  // output frames before voice ends, counting the loops to come
+  uint64_t frames_remaining(mixer_voice const &v) const {
+    if (v.voice_params.loops < 0) {
+      return std::numeric_limits<uint64_t>::max();
+    }
+    uint64_t pass = v.voice_chunk->alen / (sizeof(Sint16) * channels);
+    if (v.voice_table) {
+      pass = ((pass << 32) + v.voice_step - 1) / v.voice_step;
+    }
+    return frames_to_end(v) + v.voice_params.loops * pass;
+  }
+
+  // the gain of each side of voice k frames from now, with remaining
+  // frames before it ends, its fades and any change of gain ramping in
+  void gains_at(mixer_voice const &v, uint64_t k, uint64_t remaining,
+                float &left, float &right) const {
+    auto const &params = v.voice_params;
+    float envelope = v.voice_chunk->volume / float(MIX_MAX_VOLUME);
+    if (params.fade_in_frames > v.voice_played + k) {
+      envelope *= float(v.voice_played + k) / params.fade_in_frames;
+    }
+    if (params.fade_out_frames > remaining - k) {
+      envelope *= float(remaining - k) / params.fade_out_frames;
+    }
+    if (v.voice_fade_total) {
+      envelope *= float(v.voice_fade_left - k) / v.voice_fade_total;
+    }
+    left = params.gain_left;
+    right = params.gain_right;
+    if (v.voice_ramp_left) {
+      float through = float(k) / v.voice_ramp_left;
+      left = v.voice_left + (left - v.voice_left) * through;
+      right = v.voice_right + (right - v.voice_right) * through;
+    }
+    left *= envelope;
+    right *= envelope;
+  }
+
+  // adds frames resampled frames of voice at gain into acc, none of them
+  // past the end of its chunk; taps outside the chunk read as silence
+  void resample_frames(mixer_voice &v, float *acc, size_t frames,
+                       float gain) {
+    auto const &table = *v.voice_table;
+    auto src = reinterpret_cast<Sint16 const *>(v.voice_chunk->abuf);
+    int64_t total_frames = v.voice_chunk->alen / (sizeof(Sint16) * channels);
+    int64_t half = table.taps / 2;
+    size_t done = 0;
+    while (frames > done) {
+      int64_t frame = v.voice_phase >> 32;
+      if (frame >= half - 1 && total_frames > frame + half) {
+        // every tap up to the last such frame lies inside the chunk
+        auto last_phase = (uint64_t(total_frames - half) << 32) - 1;
+        auto n = std::min(frames - done,
+                          size_t((last_phase - v.voice_phase) / v.voice_step + 1));
+        kernels.resample(acc + done * channels, n, src, v.voice_phase,
+                         v.voice_step, table, gain);
+        done += n;
+        continue;
+      }
+      auto coefficients = table.row(v.voice_phase);
+      for (int c = 0; channels > c; ++c) {
+        float sum = 0;
+        for (int64_t t = 0; table.taps > t; ++t) {
+          auto tap = frame - half + 1 + t;
+          if (tap >= 0 && total_frames > tap) {
+            sum += coefficients[t * channels + c] * src[tap * channels + c];
+          }
+        }
+        acc[done * channels + c] += gain * sum;
+      }
+      v.voice_phase += v.voice_step;
+      ++done;
+    }
+  }
+
+  // mixes as much of voice into acc, up to frames, as has a gain changing
+  // linearly: up to where the next ramp starts or stops, or the chunk
+  // ends. Returns the frames mixed, setting ended once voice is done.
+  size_t mix_segment(mixer_voice &v, float *acc, size_t frames, bool &ended) {
+    if (!(v.voice_chunk->alen / (sizeof(Sint16) * channels))) {
+      ended = true;
+      return 0;
+    }
+    auto &params = v.voice_params;
+    auto to_end = frames_to_end(v);
+    auto remaining = frames_remaining(v);
+    uint64_t n = std::min<uint64_t>(frames, to_end);
+    auto until = [&](uint64_t point) {
+      if (point) {
+        n = std::min(n, point);
+      }
+    };
+    if (params.fade_in_frames > v.voice_played) {
+      until(params.fade_in_frames - v.voice_played);
+    }
+    if (remaining > params.fade_out_frames) {
+      until(remaining - params.fade_out_frames);
+    }
+    until(v.voice_ramp_left);
+    until(v.voice_fade_left);
+
+    float left, right, end_left, end_right;
+    gains_at(v, 0, remaining, left, right);
+    gains_at(v, n, remaining, end_left, end_right);
+    float gain[max_channels], delta[max_channels];
+    bool flat = true;
+    for (int c = 0; channels > c; ++c) {
+      bool is_right = channels == 2 && c == 1;
+      gain[c] = is_right ? right : left;
+      delta[c] = ((is_right ? end_right : end_left) - gain[c]) / n;
+      flat = flat && !delta[c] && gain[c] == gain[0];
+    }
+    if (v.voice_table) {
+      if (flat) {
+        resample_frames(v, acc, n, gain[0]);
+      } else {
+        std::fill(resampled.begin(), resampled.begin() + n * channels, 0.f);
+        resample_frames(v, resampled.data(), n, 1);
+        kernels.ramp_f32(acc, resampled.data(), n, channels, gain, delta);
+      }
+    } else {
+      auto src = reinterpret_cast<Sint16 const *>(v.voice_chunk->abuf) +
+                 v.voice_position;
+      if (flat) {
+        kernels.mix(acc, src, n * channels, gain[0]);
+      } else {
+        kernels.ramp_s16(acc, src, n, channels, gain, delta);
+      }
+      v.voice_position += n * channels;
+    }
+
+    v.voice_played += n;
+    if (v.voice_ramp_left) {
+      float through = float(n) / v.voice_ramp_left;
+      v.voice_left += (params.gain_left - v.voice_left) * through;
+      v.voice_right += (params.gain_right - v.voice_right) * through;
+      v.voice_ramp_left -= n;
+    }
+    if (v.voice_fade_total) {
+      v.voice_fade_left -= n;
+      ended = !v.voice_fade_left;
+    }
+    if (n == to_end) {
+      if (!params.loops) {
+        ended = true;
+      } else {
+        if (params.loops > 0) {
+          --params.loops;
+        }
+        v.voice_position = 0;
+        v.voice_phase %= uint64_t(v.voice_chunk->alen /
+                                  (sizeof(Sint16) * channels))
+                         << 32;
+      }
+    }
+    return n;
+  }
+
+  float *bus_buffer(int bus) {
+    return bus_buffers.data() + bus * accumulator.size();
+  }
+
+  // voice's bus, or the master if its bus has gone, or the output when
+  // there is no graph
+  float *voice_output(mixer_voice const &v) {
+    if (!graph_now) {
+      return accumulator.data();
+    }
+    auto bus = v.voice_params.bus;
+    if (graph_now->buses.size() > size_t(bus) &&
+        graph_now->buses[bus].bus_present) {
+      return bus_buffer(bus);
+    }
+    return bus_buffer(0);
+  }
+
+  // mixes voice into the block of count samples of its output; when it
+  // ends inside the block, its successor carries on from the next sample
+  void mix_voice(int voice, size_t count) {
+    while (voice >= 0) {
+      auto &v = voices[voice];
+      auto acc = voice_output(v);
+      v.voice_block = blocks_mixed;
+      auto done = v.voice_offset;
+      v.voice_offset = 0;
+      bool ended = false;
+      while (count > done && !ended) {
+        done += mix_segment(v, acc + done, (count - done) / channels, ended) *
+                channels;
+      }
+      if (!ended) {
+        return;
+      }
+      auto next = v.next_voice;
+      finish_voice(voice, frames_mixed + done / channels);
+      if (next < 0) {
+        return;
+      }
+      if (done == count) {
+        voices[next].voice_block = blocks_mixed; // starts next block
+        return;
+      }
+      voices[next].voice_offset = done;
+      voice = next;
+    }
+  }
+
+  void update_clock() {
+    if (virtual_clock) {
+      return;
+    }
+    auto now = std::chrono::duration_cast<std::chrono::microseconds>(
+                   std::chrono::system_clock::now().time_since_epoch())
+                   .count();
+    int64_t observed = now - int64_t(frames_mixed * 1000000 / frequency);
+    auto epoch = stream_epoch_micros.load(std::memory_order_relaxed);
+    // smooth out callback jitter, but follow jumps such as underruns
+    if (!epoch || std::abs(observed - epoch) > 50000) {
+      epoch = observed;
+    } else {
+      epoch += (observed - epoch) / 64;
+    }
+    stream_epoch_micros.store(epoch, std::memory_order_release);
+  }
+
+  void run_biquad(biquad const &eq, bus_state &state, float *buffer,
+                  size_t frames) {
+    for (int c = 0; channels > c; ++c) {
+      float z1 = state.state_z1[c];
+      float z2 = state.state_z2[c];
+      for (size_t f = 0; frames > f; ++f) {
+        auto &x = buffer[f * channels + c];
+        float y = eq.b0 * x + z1;
+        z1 = eq.b1 * x - eq.a1 * y + z2;
+        z2 = eq.b2 * x - eq.a2 * y;
+        x = y;
+      }
+      // don't let silence decay into denormals
+      state.state_z1[c] = std::abs(z1) < 1e-15f ? 0 : z1;
+      state.state_z2[c] = std::abs(z2) < 1e-15f ? 0 : z2;
+    }
+  }
+
+  // adds buffer into out at a gain going linearly from one to to
+  void ramp_bus(float *out, float const *buffer, size_t frames, float from,
+                float to) {
+    float gain[max_channels], delta[max_channels];
+    for (int c = 0; channels > c; ++c) {
+      gain[c] = from;
+      delta[c] = (to - from) / frames;
+    }
+    kernels.ramp_f32(out, buffer, frames, channels, gain, delta);
+  }
+
+  // adds buffer into out at the bus gain, turned down while its level is
+  // over the threshold; the level is the peak of each compressor step
+  // followed with the attack and release coefficients
+  void compress(mix_bus const &bus, bus_state &state, float *out,
+                float const *buffer, size_t frames) {
+    for (size_t f = 0; frames > f; f += compressor_frames) {
+      auto n = std::min(compressor_frames, frames - f);
+      auto peak = kernels.peak(buffer + f * channels, n * channels) *
+                  bus.bus_gain / 32768;
+      state.state_envelope +=
+          (peak - state.state_envelope) *
+          (peak > state.state_envelope ? bus.compress_attack
+                                       : bus.compress_release);
+      float gain = bus.bus_gain * bus.compress_makeup;
+      if (state.state_envelope > bus.compress_threshold) {
+        gain *= std::pow(state.state_envelope / bus.compress_threshold,
+                         1 / bus.compress_ratio - 1);
+      }
+      ramp_bus(out + f * channels, buffer + f * channels, n, state.state_gain,
+               gain);
+      state.state_gain = gain;
+    }
+  }
+
+  // filters each bus and adds it to the buses it sends to and its parent,
+  // ramping any change of gain across the block
+  void run_buses(bus_graph const &graph, size_t count) {
+    auto frames = count / channels;
+    for (auto b : graph.bus_order) {
+      auto const &bus = graph.buses[b];
+      auto &state = bus_states[b];
+      auto buffer = bus_buffer(b);
+      if (bus.bus_filtered) {
+        run_biquad(bus.bus_eq, state, buffer, frames);
+      }
+      // sends ramp on their own, from nothing when new and down to
+      // nothing when dropped, and aren't compressed
+      float sends[max_buses] = {};
+      for (auto const &send : bus.bus_sends) {
+        sends[send.first] += bus.bus_gain * send.second;
+      }
+      for (int to = 0; max_buses > to; ++to) {
+        if (sends[to] || state.state_sends[to]) {
+          ramp_bus(bus_buffer(to), buffer, frames, state.state_sends[to],
+                   sends[to]);
+          state.state_sends[to] = sends[to];
+        }
+      }
+      auto out = bus.bus_parent < 0 ? accumulator.data()
+                                    : bus_buffer(bus.bus_parent);
+      if (bus.compress_ratio > 1) {
+        compress(bus, state, out, buffer, frames);
+      } else {
+        ramp_bus(out, buffer, frames, state.state_gain, bus.bus_gain);
+        state.state_gain = bus.bus_gain;
+      }
+    }
+  }
+
+  void mix(Uint8 *stream, int len) {
+    callback_nanos = now_nanos();
+    update_clock();
+    apply_commands();
+    auto next_graph = graph.load(std::memory_order_acquire);
+    if (next_graph != graph_now && next_graph) {
+      // a bus that comes back starts from rest
+      for (size_t b = 0; bus_states.size() > b; ++b) {
+        if (next_graph->buses.size() <= b || !next_graph->buses[b].bus_present) {
+          bus_states[b] = {};
+        }
+      }
+      graph_seen.store(next_graph->graph_generation, std::memory_order_release);
+    }
+    graph_now = next_graph;
+
+    auto out = reinterpret_cast<Sint16 *>(stream);
+    size_t remaining = len / sizeof(Sint16);
+    while (remaining) {
+      auto count = std::min(remaining, accumulator.size());
+      auto acc = accumulator.data();
+      start_due_voices(count / channels);
+      std::fill(acc, acc + count, 0.f);
+      kernels.mix(acc, out, count, 1.f);
+      if (graph_now) {
+        for (auto bus : graph_now->bus_order) {
+          std::fill(bus_buffer(bus), bus_buffer(bus) + count, 0.f);
+        }
+      }
+      for (size_t voice = 0; voices.size() > voice; ++voice) {
+        auto &v = voices[voice];
+        if (!v.voice_chunk || v.voice_scheduled || v.voice_waiting ||
+            v.voice_block == blocks_mixed) {
+          continue;
+        }
+        mix_voice(voice, count);
+      }
+      if (graph_now) {
+        run_buses(*graph_now, count);
+      }
+      kernels.saturate(out, acc, count);
+      out += count;
+      remaining -= count;
+      frames_mixed += count / channels;
+      ++blocks_mixed;
+    }
+    published_frames.store(frames_mixed, std::memory_order_release);
+
+    // against how long the audio mixed lasts; offline neither means much
+    auto took = now_nanos() - callback_nanos;
+    auto lasts = int64_t(len / sizeof(Sint16) / channels) * 1000000000 /
+                 frequency;
+    callback_duration.record(took);
+    metrics.add(metric_callbacks);
+    if (!virtual_clock && took > lasts) {
+      metrics.add(metric_callback_overruns);
+    }
+    if (!virtual_clock && last_callback_nanos &&
+        callback_nanos - last_callback_nanos > lasts * 3 / 2) {
+      metrics.add(metric_underruns);
+    }
+    last_callback_nanos = callback_nanos;
+  }
+};
+
+// The SDL_mixer channels as its channel finished callback sees them. That
+// runs with the audio locked, on the audio thread or on one halting a
+// channel, so there is only ever one producer for finished. It reads
+// which sequence was on the channel, starts one chained after it on the
+// same channel, so it follows on the next sample the way
+// mixer_engine::chain_voice does, and posts the completion for the
+// libevent thread; it never waits on that thread or allocates.
+struct sdl_channel_table {
+  struct channel_completion {
+    int channel;
+    sequence_t sequence; // what finished
+    sequence_t chained;  // what the callback started after it, or 0
+  };
+  struct channel_state {
+    std::atomic<sequence_t> playing{0};
+    std::atomic<sequence_t> chained{0};
+    std::atomic<Mix_Chunk *> chained_chunk{nullptr};
+  };
+
+  int const channel_count;
+  std::unique_ptr<channel_state[]> channels;
+  spsc_ring<channel_completion> finished;
+  // completions finished had no room for, which the libevent thread
+  // recovers from channels instead
+  std::atomic<uint64_t> lost{0};
+
+  // a sequence only leaves the table once its completion is drained, so
+  // one per slot is room enough
+  sdl_channel_table(int channel_count_, size_t sequence_slots)
+      : channel_count(channel_count_),
+        channels(new channel_state[channel_count_]),
+        finished(sequence_slots) {}
+
+  // starts chunk on a free channel for sequence, marking it there first
+  // so the callback can never see the channel without it; -1 if none
+  int play(sequence_t sequence, Mix_Chunk *chunk) {
+    auto channel = Mix_GroupAvailable(-1);
+    if (channel < 0) {
+      return -1;
+    }
+    channels[channel].playing = sequence;
+    if (Mix_PlayChannel(channel, chunk, 0) < 0) {
+      channels[channel].playing = 0;
+      return -1;
+    }
+    return channel;
+  }
+
+  // has the callback start sequence on channel as after ends there.
+  // False if after has already ended, so it must be started once that
+  // completion is drained instead.
+  bool chain(int channel, sequence_t after, sequence_t sequence,
+             Mix_Chunk *chunk) {
+    auto &state = channels[channel];
+    state.chained_chunk = chunk;
+    state.chained = sequence;
+    // the callback swaps playing before chained, so either it takes
+    // sequence or this sees after has gone and takes it back
+    if (state.playing != after && state.chained.exchange(0) == sequence) {
+      return false;
+    }
+    return true;
+  }
+
+  // takes back what chain left on channel; false if the callback has
+  // already started it there
+  bool unchain(int channel, sequence_t sequence) {
+    auto chained = sequence;
+    return channels[channel].chained.compare_exchange_strong(chained, 0) ||
+           chained != 0;
+  }
+
+  // halts channel if sequence is still what plays there, rather than one
+  // started since it ended
+  void halt(int channel, sequence_t sequence) {
+    if (channels[channel].playing == sequence) {
+      Mix_HaltChannel(channel);
+    }
+  }
+
+  void channel_finished(int channel) {
+    auto &state = channels[channel];
+    channel_completion completion{channel, state.playing.exchange(0), 0};
+    if (auto chained = state.chained.exchange(0)) {
+      state.playing = chained;
+      if (Mix_PlayChannel(channel, state.chained_chunk, 0) == channel) {
+        completion.chained = chained;
+      } else {
+        // left for the libevent thread to take back and start
+        state.playing = 0;
+        state.chained = chained;
+      }
+    }
+    if (!finished.push(completion)) {
+      lost.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+};
+
+uint64_t fnv1a_64(void const *data, size_t len,
+                  uint64_t hash = 0xcbf29ce484222325ULL) {
+  auto bytes = static_cast<unsigned char const *>(data);
+  for (size_t i = 0; len > i; ++i) {
+    hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+struct sample_cache_header {
+  char magic[8];
+  uint32_t header_size;
+  int32_t frequency;
+  uint16_t format;
+  uint16_t channels;
+  uint32_t reserved;
+  uint64_t source_size;
+  uint64_t source_checksum;
+  uint64_t pcm_bytes;
+  char padding[16];
+};
+static_assert(sizeof(sample_cache_header) == 64,
+              "keep the PCM after the header 64 byte aligned");
+
+char const sample_cache_magic[8] = {'A', 'M', 'S', 'P', 'C', 'M', '0', '1'};
+
+// Directory of samples already decoded to the output format. Each file
+// is a sample_cache_header followed by the PCM, and is mmapped straight
+// into a Mix_Chunk, so nothing is decoded or copied at startup and the
+// pages are only faulted in when the sample is played.
+struct sample_cache {
+  std::string cache_directory;
+  int frequency;
+  Uint16 format;
+  int channels;
+  // with native_rate_samples entries keep the rate of their source
+  bool any_rate = false;
+
+  // chunk -> mapping, so that evicted chunks can be unmapped
+  mutable std::mutex mappings_mutex;
+  mutable std::unordered_map<Mix_Chunk *, std::pair<void *, size_t>> mappings;
+
+  std::string cache_filename(std::string const &source) const {
+    std::ostringstream oss;
+    oss << cache_directory << "/" << std::hex << std::setw(16)
+        << std::setfill('0') << fnv1a_64(source.data(), source.size())
+        << ".pcm";
+    return oss.str();
+  }
+
+  // the whole of source, read once to check its cache entry and, on a
+  // miss, decoded from memory
+  static bool read_source(std::string const &source,
+                          std::vector<char> &bytes) {
+    std::ifstream in{source, std::ios::binary};
+    if (!in.good()) {
+      return false;
+    }
+    bytes.assign(std::istreambuf_iterator<char>(in),
+                 std::istreambuf_iterator<char>());
+    return !in.bad();
+  }
+
+  // bytes is the source as read_source returned it
+  sample_cache_header header_for(std::vector<char> const &bytes) const {
+    sample_cache_header header{};
+    std::copy(std::begin(sample_cache_magic), std::end(sample_cache_magic),
+              header.magic);
+    header.header_size = sizeof(header);
+    header.frequency = frequency;
+    header.format = format;
+    header.channels = channels;
+    header.source_size = bytes.size();
+    header.source_checksum = fnv1a_64(bytes.data(), bytes.size());
+    return header;
+  }
+
+  // nullptr if there is no valid cache entry for source, whose contents
+  // are bytes; rate is the rate the PCM was stored at
+  Mix_Chunk *load(std::string const &source, std::vector<char> const &bytes,
+                  int &rate) const {
+    auto expected = header_for(bytes);
+
+    auto filename = cache_filename(source);
+    auto fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return nullptr;
+    }
+    struct stat st;
+    if (fstat(fd, &st) || size_t(st.st_size) < sizeof(sample_cache_header)) {
+      close(fd);
+      return nullptr;
+    }
+    auto mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (MAP_FAILED == mapping) {
+      log_error("mmap {}: {}", filename, std::strerror(errno));
+      return nullptr;
+    }
+
+    auto header = static_cast<sample_cache_header const *>(mapping);
+    if (!std::equal(std::begin(sample_cache_magic),
+                    std::end(sample_cache_magic), header->magic) ||
+        header->header_size != expected.header_size ||
+        (header->frequency != expected.frequency &&
+         !(any_rate && header->frequency > 0)) ||
+        header->format != expected.format ||
+        header->channels != expected.channels ||
+        header->source_size != expected.source_size ||
+        header->source_checksum != expected.source_checksum ||
+        header->pcm_bytes + sizeof(*header) != uint64_t(st.st_size)) {
+      log_info("Stale sample cache {} for {}", filename, source);
+      munmap(mapping, st.st_size);
+      return nullptr;
+    }
+
+    // SDL_mixer never writes to abuf and does not free it for
+    // Mix_QuickLoad_RAW chunks, release() unmaps it
+    auto chunk = Mix_QuickLoad_RAW(
+        static_cast<Uint8 *>(mapping) + sizeof(*header), header->pcm_bytes);
+    if (!chunk) {
+      munmap(mapping, st.st_size);
+      return nullptr;
+    }
+    rate = header->frequency;
+    std::lock_guard<std::mutex> _{mappings_mutex};
+    mappings[chunk] = {mapping, size_t(st.st_size)};
+    return chunk;
+  }
+
+  // frees a chunk returned by load(), false if it did not come from here
+  bool release(Mix_Chunk *chunk) const {
+    std::pair<void *, size_t> mapping;
+    {
+      std::lock_guard<std::mutex> _{mappings_mutex};
+      auto i = mappings.find(chunk);
+      if (i == mappings.end()) {
+        return false;
+      }
+      mapping = i->second;
+      mappings.erase(i);
+    }
+    Mix_FreeChunk(chunk);
+    munmap(mapping.first, mapping.second);
+    return true;
+  }
+
+  bool store(std::string const &source, std::vector<char> const &bytes,
+             Mix_Chunk const *chunk, int rate) const {
+    auto header = header_for(bytes);
+    header.frequency = rate;
+    header.pcm_bytes = chunk->alen;
+
+    auto filename = cache_filename(source);
+    auto temporary = filename + ".tmp" + std::to_string(getpid());
+    {
+      std::ofstream out{temporary, std::ios::binary | std::ios::trunc};
+      out.write(reinterpret_cast<char const *>(&header), sizeof(header));
+      out.write(reinterpret_cast<char const *>(chunk->abuf), chunk->alen);
+      if (!out.good()) {
+        log_error("Could not write sample cache {}", temporary);
+        std::remove(temporary.c_str());
+        return false;
+      }
+    }
+    if (std::rename(temporary.c_str(), filename.c_str())) {
+      log_error("rename {} {}", temporary, std::strerror(errno));
+      std::remove(temporary.c_str());
+      return false;
+    }
+    return true;
+  }
+};
+
+// Decodes sample files on a pool of worker threads. Results are kept in
+// the order the files were given so that merging them into chunks and
+// ordered_chunks comes out the same whichever worker finishes first.
+struct sample_loader {
+  std::vector<std::string> loader_files;
+  std::vector<Mix_Chunk *> loader_chunks;
+  std::unique_ptr<std::atomic<bool>[]> loader_done;
+  std::atomic<size_t> next_file{0};
+  std::vector<std::thread> workers;
+  size_t merged = 0; // only touched by the merging thread
+
+  template <typename Load>
+  sample_loader(std::vector<std::string> files, unsigned threads, Load load)
+      : loader_files(std::move(files)), loader_chunks(loader_files.size()),
+        loader_done(new std::atomic<bool>[loader_files.size()]) {
+    for (size_t i = 0; loader_files.size() > i; ++i) {
+      loader_done[i] = false;
+    }
+    threads = std::max(1u, std::min<unsigned>(threads, loader_files.size()));
+    for (unsigned t = 0; threads > t; ++t) {
+      workers.emplace_back([this, load] {
+        for (;;) {
+          auto i = next_file++;
+          if (i >= loader_files.size()) {
+            return;
+          }
+          loader_chunks[i] = load(loader_files[i]);
+          loader_done[i].store(true, std::memory_order_release);
+        }
+      });
+    }
+  }
+
+  ~sample_loader() {
+    next_file = loader_files.size();
+    for (auto &worker : workers) {
+      worker.join();
+    }
+  }
+
+  // calls merge(file, chunk) for each newly finished file at the front
+  // of the list, returns true once every file has been merged
+  template <typename Merge> bool merge_finished(Merge &&merge) {
+    while (loader_files.size() > merged &&
+           loader_done[merged].load(std::memory_order_acquire)) {
+      merge(loader_files[merged], loader_chunks[merged]);
+      ++merged;
+    }
+    return loader_files.size() == merged;
+  }
+};
+
+// peak amplitude of chunk at its volume, for voice_stealing quietest
+float peak_level(Mix_Chunk const *chunk) {
+  auto samples = reinterpret_cast<Sint16 const *>(chunk->abuf);
+  int peak = 0;
+  for (size_t k = 0; chunk->alen / sizeof(Sint16) > k; ++k) {
+    peak = std::max(peak, std::abs(int(samples[k])));
+  }
+  return peak * chunk->volume / float(MIX_MAX_VOLUME);
+}
+
+// A morse message rendered into one buffer, with the spacing exact to
+// the sample, and the brightness to show from each frame on.
+struct morse_render {
+  std::string morse;
+  std::vector<Uint8> pcm;
+  Mix_Chunk chunk{};
+  int frequency = 0;
+  float level = 0;
+  std::vector<std::pair<size_t, float>> timeline;
+  unsigned playing = 0; // sequences holding chunk
+};
+
+// Renders of recent messages, keyed by message text and dropped least
+// recently used first, except while they play.
+struct morse_cache {
+  size_t const capacity;
+  std::list<std::pair<std::string, std::unique_ptr<morse_render>>> lru;
+  std::unordered_map<std::string, decltype(lru)::iterator> by_message;
+  // every render in lru, named or not, so play finds its own in O(1)
+  std::unordered_map<Mix_Chunk const *, morse_render *> by_chunk;
+
+  explicit morse_cache(size_t capacity_) : capacity(capacity_) {}
+
+  morse_render *find(std::string const &message) {
+    auto i = by_message.find(message);
+    if (i == by_message.end()) {
+      return nullptr;
+    }
+    lru.splice(lru.begin(), lru, i->second);
+    return i->second->second.get();
+  }
+
+  morse_render *insert(std::string const &message,
+                       std::unique_ptr<morse_render> render) {
+    auto i = by_message.find(message);
+    if (i != by_message.end() && !i->second->second->playing) {
+      by_chunk.erase(&i->second->second->chunk);
+      lru.erase(i->second);
+      by_message.erase(i);
+    } else if (i != by_message.end()) {
+      // still playing under this key; the new render stays unnamed
+      // until that one is evicted
+      by_message.erase(i);
+    }
+    by_chunk[&render->chunk] = render.get();
+    lru.emplace_front(message, std::move(render));
+    by_message[message] = lru.begin();
+    evict();
+    return lru.front().second.get();
+  }
+
+  void evict() {
+    for (auto i = lru.end(); lru.size() > capacity && i != lru.begin();) {
+      --i;
+      if (i->second->playing) {
+        continue;
+      }
+      auto named = by_message.find(i->first);
+      if (named != by_message.end() && named->second == i) {
+        by_message.erase(named);
+      }
+      by_chunk.erase(&i->second->chunk);
+      i = lru.erase(i);
+    }
+  }
+
+  bool pin(Mix_Chunk *chunk) { return adjust(chunk, 1); }
+
+  // renders are only freed by insert, never from the audio thread
+  bool unpin(Mix_Chunk *chunk) { return adjust(chunk, -1); }
+
+  bool adjust(Mix_Chunk *chunk, int pins) {
+    auto render = rendered(chunk);
+    if (render) {
+      render->playing += pins;
+    }
+    return render;
+  }
+
+  // the render playing chunk, if any
+  morse_render *rendered(Mix_Chunk const *chunk) {
+    auto i = by_chunk.find(chunk);
+    return i == by_chunk.end() ? nullptr : i->second;
+  }
+};
+
+// Bookkeeping for --sample_memory_budget: samples are decoded on first
+// play and the least recently used are freed once the resident PCM goes
+// over budget. Every sequence holding a chunk pins it, so a chunk that
+// is playing or queued is never freed under it.
+struct sample_budget {
+  struct resident_sample {
+    std::string sample_name;
+    size_t sample_bytes;
+    unsigned sample_pins;
+    std::list<Mix_Chunk *>::iterator lru_position;
+  };
+
+  size_t const budget_bytes;
+  size_t resident_bytes = 0;
+  std::list<Mix_Chunk *> lru; // most recently used first
+  std::unordered_map<Mix_Chunk *, resident_sample> residents;
+
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+  uint64_t evictions = 0;
+  double decode_millis_total = 0;
+  double decode_millis_max = 0;
+
+  explicit sample_budget(size_t bytes) : budget_bytes(bytes) {}
+
+  void hit(Mix_Chunk *chunk) {
+    ++hits;
+    auto i = residents.find(chunk);
+    if (i != residents.end()) {
+      lru.splice(lru.begin(), lru, i->second.lru_position);
+    }
+  }
+
+  void add(std::string const &name, Mix_Chunk *chunk, double decode_millis) {
+    ++misses;
+    decode_millis_total += decode_millis;
+    decode_millis_max = std::max(decode_millis_max, decode_millis);
+    lru.push_front(chunk);
+    residents[chunk] = {name, chunk->alen, 0, lru.begin()};
+    resident_bytes += chunk->alen;
+  }
+
+  // stops accounting for a chunk that is being replaced
+  void forget(Mix_Chunk *chunk) {
+    auto i = residents.find(chunk);
+    if (i != residents.end()) {
+      resident_bytes -= i->second.sample_bytes;
+      lru.erase(i->second.lru_position);
+      residents.erase(i);
+    }
+  }
+
+  void pin(Mix_Chunk *chunk) {
+    auto i = residents.find(chunk);
+    if (i != residents.end()) {
+      ++i->second.sample_pins;
+    }
+  }
+
+  void unpin(Mix_Chunk *chunk) {
+    auto i = residents.find(chunk);
+    if (i != residents.end() && i->second.sample_pins) {
+      --i->second.sample_pins;
+    }
+  }
+
+  // drops unpinned samples from the cold end until within budget and
+  // returns them for the caller to free
+  std::vector<std::pair<std::string, Mix_Chunk *>> evict() {
+    std::vector<std::pair<std::string, Mix_Chunk *>> ret;
+    for (auto i = lru.end();
+         resident_bytes > budget_bytes && i != lru.begin();) {
+      --i;
+      auto r = residents.find(*i);
+      if (r->second.sample_pins) {
+        continue;
+      }
+      ret.emplace_back(r->second.sample_name, r->first);
+      resident_bytes -= r->second.sample_bytes;
+      ++evictions;
+      residents.erase(r);
+      i = lru.erase(i);
+    }
+    return ret;
+  }
+
+  void write_stats(std::ostream &out) const {
+    auto lookups = hits + misses;
+    out << "RESIDENT " << resident_bytes << " BUDGET " << budget_bytes
+        << " SAMPLES " << residents.size() << std::endl
+        << "HITS " << hits << " MISSES " << misses << " HIT_RATE "
+        << (lookups ? double(hits) / lookups : 0) << std::endl
+        << "DECODE_MILLIS_AVG " << (misses ? decode_millis_total / misses : 0)
+        << " DECODE_MILLIS_MAX " << decode_millis_max << std::endl
+        << "EVICTIONS " << evictions << std::endl;
+  }
+};
+
+bool has_sample_extension(std::string const &name) {
+  auto dot = name.rfind('.');
+  if (dot == std::string::npos) {
+    return false;
+  }
+  auto extension = name.substr(dot + 1);
+  std::transform(extension.begin(), extension.end(), extension.begin(),
+                 [](unsigned char c) { return std::tolower(c); });
+  return extension == "wav" || extension == "ogg" || extension == "mp3" ||
+         extension == "flac" || extension == "opus";
+}
+
+// Watches the directories of the sample files with inotify. A thread of
+// its own waits on the inotify fd and (if asked to) decodes new and
+// changed files, then hands them to the libevent thread through
+// take_reloaded() and a byte on wake_fd. A byte on its stop pipe ends
+// the thread, which the destructor joins.
+struct sample_watcher {
+  int inotify_fd = -1;
+  int wake_pipe[2] = {-1, -1};
+  int stop_pipe[2] = {-1, -1};
+  std::unordered_map<int, std::string> watch_prefixes;
+  std::mutex reloaded_mutex;
+  std::vector<std::pair<std::string, Mix_Chunk *>> reloaded;
+  std::thread watch_thread;
+
+  ~sample_watcher() {
+    if (watch_thread.joinable()) {
+      char stop = 0;
+      if (write(stop_pipe[1], &stop, 1) < 0) {
+        log_error("sample_watcher stop {}", std::strerror(errno));
+      }
+      watch_thread.join();
+    }
+    close_fds();
+  }
+
+  void close_fds() {
+    for (auto fd : {inotify_fd, wake_pipe[0], wake_pipe[1], stop_pipe[0],
+                    stop_pipe[1]}) {
+      if (fd >= 0) {
+        close(fd);
+      }
+    }
+    inotify_fd = wake_pipe[0] = wake_pipe[1] = stop_pipe[0] = stop_pipe[1] =
+        -1;
+  }
+
+  int wake_fd() const { return wake_pipe[0]; }
+
+  // prefix is a sample name up to and including its last '/', so that
+  // reloaded files get the same names as the ones on the command line
+  bool start(std::vector<std::string> const &prefixes,
+             std::function<Mix_Chunk *(std::string const &)> decode) {
+#ifdef __linux__
+    inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (inotify_fd < 0) {
+      log_error("inotify_init1 {}", std::strerror(errno));
+      return false;
+    }
+    if (pipe(wake_pipe) || evutil_make_socket_nonblocking(wake_pipe[0]) ||
+        pipe(stop_pipe)) {
+      log_error("pipe {}", std::strerror(errno));
+      close_fds();
+      return false;
+    }
+    for (auto &prefix : prefixes) {
+      auto directory = prefix.empty() ? std::string(".") : prefix;
+      auto wd = inotify_add_watch(inotify_fd, directory.c_str(),
+                                  IN_CLOSE_WRITE | IN_MOVED_TO);
+      if (wd < 0) {
+        log_error("inotify_add_watch {} {}", directory, std::strerror(errno));
+        continue;
+      }
+      log_info("Watching {} for samples", directory);
+      watch_prefixes[wd] = prefix;
+    }
+
+    watch_thread = std::thread([this, decode] {
+      alignas(inotify_event) char buf[1 << 14];
+      for (;;) {
+        pollfd fds[] = {{inotify_fd, POLLIN, 0}, {stop_pipe[0], POLLIN, 0}};
+        if (poll(fds, 2, -1) < 0) {
+          if (errno == EINTR) {
+            continue;
+          }
+          log_error("sample_watcher poll {}", std::strerror(errno));
+          return;
+        }
+        if (fds[1].revents) {
+          return;
+        }
+        auto len = read(inotify_fd, buf, sizeof(buf));
+        if (len < 0 && errno == EINTR) {
+          continue;
+        }
+        if (len <= 0) {
+          log_error("inotify read {}", std::strerror(errno));
+          return;
+        }
+        for (char *p = buf; buf + len > p;) {
+          auto event = reinterpret_cast<inotify_event const *>(p);
+          p += sizeof(inotify_event) + event->len;
+          auto prefix = watch_prefixes.find(event->wd);
+          if (!event->len || prefix == watch_prefixes.end() ||
+              !has_sample_extension(event->name)) {
+            continue;
+          }
+          auto name = prefix->second + event->name;
+          auto chunk = decode ? decode(name) : nullptr;
+          {
+            std::lock_guard<std::mutex> _{reloaded_mutex};
+            reloaded.emplace_back(name, chunk);
+          }
+          char wake = 0;
+          if (write(wake_pipe[1], &wake, 1) < 0) {
+            log_error("sample_watcher write {}", std::strerror(errno));
+          }
+        }
+      }
+    });
+    return true;
+#else
+    log_error("watch_sample_dirs needs inotify");
+    return false;
+#endif
+  }
+
+  std::vector<std::pair<std::string, Mix_Chunk *>> take_reloaded() {
+    char drain[64];
+    while (read(wake_pipe[0], drain, sizeof(drain)) > 0) {
+    }
+    std::vector<std::pair<std::string, Mix_Chunk *>> ret;
+    std::lock_guard<std::mutex> _{reloaded_mutex};
+    ret.swap(reloaded);
+    return ret;
+  }
+};
+
+// The laser relay on a GPIO line, held open and written only when its
+// level changes. gpio_path is a value file, as under /sys/class/gpio, or
+// a GPIO character device such as /dev/gpiochip0, whose gpio_line is
+// requested once and kept. Edges are queued with the wall clock time
+// they are due, worked out from the audio clock, and a thread of its own
+// writes each on time; edges that fall due together are written as the
+// last of them.
+struct laser_driver {
+  // the driver stops waiting for changes this long before an edge, then
+  // sleeps on the monotonic clock until spin_micros before it and spins
+  // the rest of the way, as waits overshoot by up to a scheduler tick
+  static int64_t const wake_early_micros = 2000;
+  static int64_t const spin_micros = 200;
+  struct laser_edge {
+    int64_t due_micros;
+    int edge_level;
+    sequence_t edge_owner; // the sequence it lights up, or 0
+  };
+  int fd = -1;
+  bool line_handle = false; // fd is a character device line, not a file
+  int off_value = 1;
+  int written = -1; // level on the line, driver thread only
+  std::mutex edges_mutex;
+  std::condition_variable edges_changed;
+  std::deque<laser_edge> edges; // in due order
+  bool stopping = false;
+  std::thread driver;
+  std::atomic<uint64_t> writes{0};
+  std::atomic<int64_t> max_late_micros{0};
+  bool realtime = false; // the driver thread has SCHED_FIFO
+
+  ~laser_driver() {
+    if (driver.joinable()) {
+      {
+        std::lock_guard<std::mutex> _{edges_mutex};
+        stopping = true;
+      }
+      edges_changed.notify_one();
+      driver.join();
+    }
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+
+  bool open_line(std::string const &path, int line, int off) {
+    off_value = off;
+#ifdef __linux__
+    struct stat st;
+    if (!stat(path.c_str(), &st) && S_ISCHR(st.st_mode)) {
+      auto chip = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+      if (chip < 0) {
+        log_error("open {}: {}", path, std::strerror(errno));
+        return false;
+      }
+      gpio_v2_line_request request{};
+      request.offsets[0] = line;
+      request.num_lines = 1;
+      std::strncpy(request.consumer, "audiomixserver",
+                   sizeof(request.consumer) - 1);
+      request.config.flags = GPIO_V2_LINE_FLAG_OUTPUT;
+      request.config.num_attrs = 1;
+      request.config.attrs[0].attr.id = GPIO_V2_LINE_ATTR_ID_OUTPUT_VALUES;
+      request.config.attrs[0].attr.values = off_value & 1;
+      request.config.attrs[0].mask = 1;
+      auto requested = !ioctl(chip, GPIO_V2_GET_LINE_IOCTL, &request);
+      auto error = errno;
+      close(chip);
+      if (!requested) {
+        log_error("GPIO_V2_GET_LINE_IOCTL {} line {}: {}", path, line,
+                  std::strerror(error));
+        return false;
+      }
+      fd = request.fd;
+      line_handle = true;
+    }
+#endif
+    if (fd < 0) {
+      fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+      if (fd < 0) {
+        log_error("open {}: {}", path, std::strerror(errno));
+        return false;
+      }
+    }
+    // starts off, whatever a previous run left it at
+    if (!write_level(0)) {
+      return false;
+    }
+    written = 0;
+    driver = std::thread([this] { drive(); });
+    sched_param param{};
+    param.sched_priority = sched_get_priority_min(SCHED_FIFO);
+    auto error = pthread_setschedparam(driver.native_handle(), SCHED_FIFO,
+                                       &param);
+    if (error) {
+      log_warning("laser driver left without SCHED_FIFO: {}",
+                  std::strerror(error));
+    }
+    realtime = !error;
+    return true;
+  }
+
+  bool write_level(int level) {
+    int value = level ^ off_value;
+#ifdef __linux__
+    if (line_handle) {
+      gpio_v2_line_values values{};
+      values.bits = value & 1;
+      values.mask = 1;
+      if (ioctl(fd, GPIO_V2_LINE_SET_VALUES_IOCTL, &values)) {
+        log_error("GPIO_V2_LINE_SET_VALUES_IOCTL {}", std::strerror(errno));
+        return false;
+      }
+      return true;
+    }
+#endif
+    char c = '0' + value;
+    if (pwrite(fd, &c, 1, 0) != 1) {
+      log_error("laser write {}", std::strerror(errno));
+      return false;
+    }
+    return true;
+  }
+
+  // the level the line is at, -1 if it can't be read
+  int read_level() {
+#ifdef __linux__
+    if (line_handle) {
+      gpio_v2_line_values values{};
+      values.mask = 1;
+      if (ioctl(fd, GPIO_V2_LINE_GET_VALUES_IOCTL, &values)) {
+        return -1;
+      }
+      return int(values.bits & 1) ^ off_value;
+    }
+#endif
+    char c;
+    if (pread(fd, &c, 1, 0) != 1) {
+      return -1;
+    }
+    return (c - '0') ^ off_value;
+  }
+
+  void schedule(int level, int64_t due_micros, sequence_t owner = 0) {
+    if (fd < 0) {
+      return;
+    }
+    bool first;
+    {
+      std::lock_guard<std::mutex> _{edges_mutex};
+      auto at = std::upper_bound(edges.begin(), edges.end(), due_micros,
+                                 [](int64_t due, laser_edge const &edge) {
+                                   return due < edge.due_micros;
+                                 });
+      first = edges.begin() == at;
+      edges.insert(at, {due_micros, level, owner});
+    }
+    if (first) {
+      edges_changed.notify_one();
+    }
+  }
+
+  // drops owner's edges due after due_micros, as when what they light
+  // up is stopped early, and leaves every other sequence's alone
+  void cancel_after(int64_t due_micros, sequence_t owner) {
+    std::lock_guard<std::mutex> _{edges_mutex};
+    edges.erase(std::remove_if(edges.begin(), edges.end(),
+                               [&](laser_edge const &edge) {
+                                 return edge.edge_owner == owner &&
+                                        edge.due_micros > due_micros;
+                               }),
+                edges.end());
+  }
+
+  static int64_t monotonic_nanos() {
+#ifdef __linux__
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * int64_t(1000000000) + now.tv_nsec;
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+#endif
+  }
+
+  // due_micros is on the wall clock, as the audio clock is. It becomes a
+  // monotonic deadline once, so both the sleep and the spin after it
+  // ignore any step in the wall clock meanwhile.
+  static void sleep_until_due(int64_t due_micros) {
+    auto deadline = monotonic_nanos() + due_micros * 1000 - now_nanos();
+    auto wake = deadline - spin_micros * 1000;
+    if (wake > monotonic_nanos()) {
+#ifdef __linux__
+      timespec until;
+      until.tv_sec = wake / 1000000000;
+      until.tv_nsec = wake % 1000000000;
+      while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until,
+                             nullptr) == EINTR) {
+      }
+#else
+      std::this_thread::sleep_for(
+          std::chrono::nanoseconds(wake - monotonic_nanos()));
+#endif
+    }
+    while (deadline > monotonic_nanos()) {
+    }
+  }
+
+  void drive() {
+    logger.claim_ring();
+    std::unique_lock<std::mutex> lock{edges_mutex};
+    while (!stopping) {
+      if (edges.empty()) {
+        edges_changed.wait(lock);
+        continue;
+      }
+      auto due = edges.front().due_micros;
+      auto wait = due - now_nanos() / 1000;
+      if (wait > wake_early_micros) {
+        edges_changed.wait_for(
+            lock, std::chrono::microseconds(wait - wake_early_micros));
+        continue;
+      }
+      if (wait > 0) {
+        // an edge scheduled meanwhile waits for this one
+        lock.unlock();
+        sleep_until_due(due);
+        lock.lock();
+      }
+      auto now = now_nanos() / 1000;
+      if (edges.empty() || edges.front().due_micros > now) {
+        continue; // cancelled while asleep
+      }
+      auto edge = edges.front();
+      // late from the first edge due, so a flash missed altogether counts
+      auto first_due = edge.due_micros;
+      edges.pop_front();
+      while (!edges.empty() && edges.front().due_micros <= now) {
+        edge = edges.front();
+        edges.pop_front();
+      }
+      lock.unlock();
+      if (edge.edge_level != written && write_level(edge.edge_level)) {
+        written = edge.edge_level;
+        ++writes;
+      }
+      auto late = now_nanos() / 1000 - first_due;
+      if (late > max_late_micros) {
+        max_late_micros = late;
+      }
+      lock.lock();
+    }
+  }
+};
+
+// Client for the fire server, the Pico W that starts the fire. Requests
+// go out over a few kept-alive connections with at most one in flight on
+// each, and otherwise wait in a bounded queue that drops its oldest. A
+// path already waiting, in flight or sent within the coalescing window
+// is not asked for again. A failed request is retried after a backoff
+// that doubles with each failure in a row, and nothing else is sent
+// until it is over. All on the libevent thread.
+struct fire_client {
+  static int64_t const first_backoff_nanos = 100000000;
+  static constexpr int64_t max_backoff_nanos = 5000000000;
+  struct fire_request {
+    std::string request_path;
+    int attempts;
+  };
+  struct fire_connection {
+    fire_client *client;
+    evhttp_connection *evcon = nullptr;
+    bool busy = false;
+    fire_request in_flight;
+    int64_t sent_nanos = 0;
+  };
+  std::string host;
+  std::vector<std::unique_ptr<fire_connection>> connections;
+  std::deque<fire_request> waiting;
+  size_t queue_limit = 0;
+  int retries = 0;
+  int64_t coalesce_nanos = 0;
+  std::unordered_map<std::string, int64_t> last_sent_nanos; // by path
+  int64_t backoff_nanos = 0; // 0 unless the last request failed
+  int64_t backoff_until_nanos = 0;
+  bool backoff_event_added = false;
+  struct event backoff_event;
+
+  latency_histogram durations;
+  uint64_t sent = 0, succeeded = 0, failed = 0, retried = 0, coalesced = 0,
+           dropped = 0;
+
+  ~fire_client() {
+    if (backoff_event_added) {
+      event_del(&backoff_event);
+    }
+    for (auto &connection : connections) {
+      evhttp_connection_free(connection->evcon);
+    }
+  }
+
+  bool init(std::string const &address, int port, int connection_count,
+            int timeout_ms, size_t queue, int retry_limit, int coalesce_ms) {
+    host = address;
+    queue_limit = queue;
+    retries = retry_limit;
+    coalesce_nanos = int64_t(coalesce_ms) * 1000000;
+    struct timeval timeout;
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_usec = timeout_ms % 1000 * 1000;
+    for (int c = 0; connection_count > c; ++c) {
+      auto connection = std::make_unique<fire_connection>();
+      connection->client = this;
+      connection->evcon = evhttp_connection_new(address.c_str(), port);
+      if (!connection->evcon) {
+        log_error("evhttp_connection_new {}:{}", address, port);
+        return false;
+      }
+      evhttp_connection_set_timeout_tv(connection->evcon, &timeout);
+      connections.push_back(std::move(connection));
+    }
+    return !connections.empty();
+  }
+
+  void request(std::string path) {
+    if (path.empty() || '/' != path[0]) {
+      path.insert(0, "/");
+    }
+    auto now = now_nanos();
+    auto last = last_sent_nanos.find(path);
+    bool repeat = last != last_sent_nanos.end() &&
+                  coalesce_nanos > now - last->second;
+    for (auto const &w : waiting) {
+      repeat = repeat || w.request_path == path;
+    }
+    for (auto const &connection : connections) {
+      repeat = repeat ||
+               (connection->busy && connection->in_flight.request_path == path);
+    }
+    if (repeat) {
+      ++coalesced;
+      return;
+    }
+    if (queue_limit <= waiting.size()) {
+      log_warning("fire server queue full, dropping {}",
+                  waiting.front().request_path);
+      ++dropped;
+      waiting.pop_front();
+    }
+    waiting.push_back({path, 0});
+    dispatch();
+  }
+
+  bool idle() const {
+    for (auto const &connection : connections) {
+      if (connection->busy) {
+        return false;
+      }
+    }
+    return waiting.empty();
+  }
+
+  void dispatch() {
+    auto now = now_nanos();
+    if (backoff_until_nanos > now) {
+      if (!backoff_event_added) {
+        auto wait_micros = (backoff_until_nanos - now + 999) / 1000;
+        struct timeval delay;
+        delay.tv_sec = wait_micros / 1000000;
+        delay.tv_usec = wait_micros % 1000000;
+        event_set(&backoff_event, -1, 0,
+                  [](evutil_socket_t, short, void *client) -> void {
+                    auto c = static_cast<fire_client *>(client);
+                    c->backoff_event_added = false;
+                    c->dispatch();
+                  },
+                  this);
+        event_add(&backoff_event, &delay);
+        backoff_event_added = true;
+      }
+      return;
+    }
+    for (auto &connection : connections) {
+      if (waiting.empty()) {
+        return;
+      }
+      if (!connection->busy) {
+        auto request = std::move(waiting.front());
+        waiting.pop_front();
+        send(*connection, std::move(request));
+      }
+    }
+  }
+
+  void send(fire_connection &connection, fire_request request) {
+    log_info("fire server request {}", request.request_path);
+    ++request.attempts;
+    ++sent;
+    last_sent_nanos[request.request_path] = now_nanos();
+    auto req = evhttp_request_new(
+        [](evhttp_request *req, void *connection) -> void {
+          auto c = static_cast<fire_connection *>(connection);
+          c->client->done(*c, req);
+        },
+        &connection);
+    evhttp_add_header(evhttp_request_get_output_headers(req), "Host",
+                      host.c_str());
+    connection.busy = true;
+    connection.in_flight = std::move(request);
+    connection.sent_nanos = now_nanos();
+    if (evhttp_make_request(connection.evcon, req, EVHTTP_REQ_GET,
+                            connection.in_flight.request_path.c_str())) {
+      log_error("evhttp_make_request {}",
+                connection.in_flight.request_path);
+      connection.busy = false;
+      failed_attempt(std::move(connection.in_flight));
+    }
+  }
+
+  void done(fire_connection &connection, evhttp_request *req) {
+    connection.busy = false;
+    durations.record(now_nanos() - connection.sent_nanos);
+    auto code = req ? evhttp_request_get_response_code(req) : 0;
+    if (200 <= code && 300 > code) {
+      auto body = evhttp_request_get_input_buffer(req);
+      auto len = evbuffer_get_length(body);
+      log_info("fire server {} replied {}", connection.in_flight.request_path,
+               std::string(reinterpret_cast<char const *>(
+                               evbuffer_pullup(body, len)),
+                           len));
+      ++succeeded;
+      backoff_nanos = 0;
+    } else {
+      log_warning("fire server {} failed with {}",
+                  connection.in_flight.request_path, code);
+      failed_attempt(std::move(connection.in_flight));
+    }
+    dispatch();
+  }
+
+  void failed_attempt(fire_request request) {
+    backoff_nanos = backoff_nanos
+                        ? std::min(2 * backoff_nanos, max_backoff_nanos)
+                        : first_backoff_nanos;
+    backoff_until_nanos = now_nanos() + backoff_nanos;
+    if (retries >= request.attempts) {
+      if (queue_limit <= waiting.size() && !waiting.empty()) {
+        // the retry goes first, so what makes room for it is the newest
+        // request not yet tried, or failing that the newest retry
+        auto drop = std::find_if(waiting.rbegin(), waiting.rend(),
+                                 [](fire_request const &w) {
+                                   return !w.attempts;
+                                 });
+        auto at = drop == waiting.rend() ? waiting.end() - 1
+                                         : std::prev(drop.base());
+        log_warning("fire server queue full, dropping {}", at->request_path);
+        ++dropped;
+        waiting.erase(at);
+      }
+      ++retried;
+      waiting.push_front(std::move(request));
+      return;
+    }
+    log_error("fire server gave up on {} after {} attempts",
+              request.request_path, request.attempts);
+    ++failed;
+    last_sent_nanos.erase(request.request_path);
+  }
+};
+
+// One SO_REUSEPORT socket with an event base and thread of its own. A
+// byte on stop_pipe breaks the loop from its own thread, as the base is
+// not shared between threads; the destructor sends it, joins the thread
+// and only then frees the events, base and socket.
+struct udp_worker {
+  context *worker_ctx;
+  evutil_socket_t worker_sock = -1;
+  event_base *worker_base = nullptr;
+  event *worker_event = nullptr;
+  event *stop_event = nullptr;
+  int stop_pipe[2] = {-1, -1};
+  std::thread worker_thread;
+  std::unordered_map<std::string, uint64_t> client_tokens;
+  std::unordered_map<uint64_t, uint64_t> binary_client_tokens;
+#ifdef __linux__
+  std::unique_ptr<udp_batch> worker_batch;
+#endif
+
+  ~udp_worker() {
+    if (worker_thread.joinable()) {
+      char stop = 0;
+      if (write(stop_pipe[1], &stop, 1) < 0) {
+        log_error("udp worker stop {}", std::strerror(errno));
+      }
+      worker_thread.join();
+    }
+    for (auto ev : {worker_event, stop_event}) {
+      if (ev) {
+        event_free(ev);
+      }
+    }
+    if (worker_base) {
+      event_base_free(worker_base);
+    }
+    for (auto fd : stop_pipe) {
+      if (fd >= 0) {
+        close(fd);
+      }
+    }
+    if (worker_sock >= 0) {
+      evutil_closesocket(worker_sock);
+    }
+  }
+};
+
+struct context {
+  std::unordered_map<std::string, Mix_Chunk *> chunks;
+  std::unordered_map<std::string, uint64_t> client_tokens;
+  std::unordered_map<uint64_t, uint64_t> binary_client_tokens;
+#ifdef __linux__
+  std::unique_ptr<udp_batch> batch;
+#endif
+  trigger_latency latency;
+  // the request being handled, 0 outside one
+  int64_t request_received_nanos = 0;
+  int64_t request_dispatched_nanos = 0;
+  // outside a timed_request only render_script sends requests
+  transport request_transport = transport_script;
+  std::unique_ptr<mpsc_ring<udp_work>> udp_queue;
+  int udp_wake_pipe[2] = {-1, -1};
+  std::atomic<bool> udp_wake_pending{false};
+  struct event udp_wake_event;
+  // after the queue and pipe they post to, so their threads are joined
+  // before those go
+  std::vector<std::unique_ptr<udp_worker>> udp_workers;
+  std::vector<Mix_Chunk *> ordered_chunks;
+  // with a sample_budget, chunks holds nullptr for samples that are not
+  // resident and ordered_chunks only placeholders; indexes resolve
+  // through ordered_names instead
+  std::vector<std::string> ordered_names;
+  boost::program_options::variables_map &vm;
+  struct event udp_event;
+  // without the lockfree mixer
+  std::unique_ptr<sdl_channel_table> sdl_channels;
+  struct event completion_event;
+  fire_client fire;
+  std::unique_ptr<mixer_engine> mixer;
+  // after the rings it watches, so its thread is gone before they are
+  completion_signal completions_posted;
+  std::unique_ptr<sample_cache> cache;
+  std::unique_ptr<sample_loader> loader;
+  std::unique_ptr<sample_budget> budget;
+  std::unique_ptr<sample_watcher> watcher;
+  struct event watcher_event;
+  // replaced chunks still held by sequences -> number of such sequences
+  std::unordered_map<Mix_Chunk *, unsigned> retired_chunks;
+  std::vector<Mix_Chunk *> chunks_to_free;
+  std::unordered_set<std::string> loading_files;
+  struct event loader_event;
+  std::unique_ptr<morse_cache> morse_renders;
+  // the morse render whose brightness timeline is showing
+  morse_render *morse_showing = nullptr;
+  sequence_t morse_sequence = 0;
+  long morse_started_millis = 0;
+  size_t morse_step = 0;
+  bool morse_event_added = false;
+  struct event morse_event;
+  laser_driver laser;
+
+  sequence_table sequences;
+  voice_stealer stealer;
+  std::unordered_map<std::string, int> sample_priorities;
+  // what voice stealing weighs each loaded chunk by, worked out as it is
+  // registered so that play only looks them up
+  struct chunk_weight {
+    int priority;
+    float level;
+  };
+  std::unordered_map<Mix_Chunk *, chunk_weight> chunk_weights;
+  // chunks loaded at a rate other than the output's, by native_rate_samples
+  std::mutex chunk_rates_mutex;
+  std::unordered_map<Mix_Chunk *, int> chunk_rates;
+  // buses set over HTTP; a bus keeps its place in bus_names, which is its
+  // number in the mixer, so voices routed to it find it if it comes back
+  std::vector<std::string> bus_names{"master"};
+  std::unordered_map<std::string, bus_settings> buses{{"master", {}}};
+
+  GLclampf background_r;
+  GLclampf background_g;
+  GLclampf background_b;
+
+  helio_gl_rainbow gl_rainbow;
+  helio_gl_lozenge gl_lozenge;
+  helio_gl_sprites gl_sprites;
+
+  context(boost::program_options::variables_map &vm_)
+      : vm(vm_),
+        sequences(vm_["sequence_slots"].as<size_t>(), voice_count(vm_)),
+        stealer(vm_["allocate_sdl_channels"].as<int>(), voice_count(vm_)),
+        background_r(0), background_g(0), background_b(0) {}
+
+  // allocate_sdl_channels, plus the voices stolen ones fade out on
+  static int voice_count(boost::program_options::variables_map &vm) {
+    auto count = vm["allocate_sdl_channels"].as<int>();
+    if (vm["voice_stealing"].as<std::string>() != "none") {
+      count += vm["steal_fade_voices"].as<int>();
+    }
+    return count;
+  }
+
+  context(const context&) = delete;
+
+  Mix_Chunk *name_to_chunk(std::string const &name) {
+    auto p = chunks.find(name);
+
+    if (ordered_chunks.empty()) {
+      if (!loader) {
+        log_info("No songs loaded - pass them at the command line");
+      }
+      return 0;
+    }
+    if (p != chunks.end()) {
+      log_debug("Chunk {} is {}", name, p->second);
+      return budget ? resident_chunk(p->first) : p->second;
+    }
+
+    if (name == "play" || name == "/play" || name.empty()) {
+      return budget ? resident_chunk(ordered_names[0]) : ordered_chunks[0];
+    }
+
+    unsigned long index;
+    try {
+      index = std::stoul(name);
+    } catch (std::exception &e) {
+      log_warning("Unknown song {}", name);
+      return 0;
+    }
+    return index_to_chunk(index);
+  }
+
+  Mix_Chunk *index_to_chunk(unsigned long index) {
+    if (ordered_chunks.empty()) {
+      return 0;
+    }
+    if (loader && index >= ordered_chunks.size()) {
+      // don't wrap around onto a different sample while still loading
+      return 0;
+    }
+    index %= ordered_chunks.size();
+    return budget ? resident_chunk(ordered_names[index])
+                  : ordered_chunks[index];
+  }
+
+  // decodes the sample on a miss; the chunk is unpinned and may be
+  // evicted at the end of the request unless a sequence takes it
+  Mix_Chunk *resident_chunk(std::string const &name) {
+    auto &chunk = chunks[name];
+    if (chunk) {
+      budget->hit(chunk);
+      return chunk;
+    }
+
+    auto begin = std::chrono::steady_clock::now();
+    auto loaded = load_sample_file(name);
+    if (!loaded) {
+      return nullptr;
+    }
+    std::chrono::duration<double, std::milli> decode_time =
+        std::chrono::steady_clock::now() - begin;
+
+    budget->add(name, loaded, decode_time.count());
+    weigh_chunk(name, loaded);
+    return chunk = loaded;
+  }
+
+  void pin_chunk(Mix_Chunk *chunk) {
+    if (morse_renders && morse_renders->pin(chunk)) {
+      return;
+    }
+    if (budget) {
+      budget->pin(chunk);
+    }
+  }
+
+  void unpin_chunk(Mix_Chunk *chunk) {
+    if (morse_renders && morse_renders->unpin(chunk)) {
+      return;
+    }
+    if (budget) {
+      budget->unpin(chunk);
+    }
+    auto r = retired_chunks.find(chunk);
+    if (r != retired_chunks.end() && !--r->second) {
+      chunks_to_free.push_back(chunk);
+      retired_chunks.erase(r);
+    }
+  }
+
+  // frees chunk once the last sequence playing or queueing it is done
+  void retire_chunk(Mix_Chunk *chunk) {
+    if (budget) {
+      budget->forget(chunk);
+    }
+    unsigned holders = 0;
+    sequences.for_each([&](sequence_t, sequence_status const &status) {
+      if (status.sequence_chunk == chunk) {
+        ++holders;
+      }
+    });
+    if (holders) {
+      retired_chunks[chunk] = holders;
+    } else {
+      chunks_to_free.push_back(chunk);
+    }
+  }
+
+  void free_retired_chunks() {
+    std::vector<Mix_Chunk *> to_free;
+    to_free.swap(chunks_to_free);
+    for (auto chunk : to_free) {
+      free_chunk(chunk);
+    }
+  }
+
+  void enforce_sample_budget() {
+    free_retired_chunks();
+    if (!budget) {
+      return;
+    }
+    auto evicted = budget->evict();
+    for (auto &e : evicted) {
+      log_info("Evicting {}", e.first);
+      chunks[e.first] = nullptr;
+      free_chunk(e.second);
+    }
+  }
+
+  void free_chunk(Mix_Chunk *chunk) {
+    chunk_weights.erase(chunk);
+    {
+      std::lock_guard<std::mutex> _{chunk_rates_mutex};
+      chunk_rates.erase(chunk);
+    }
+    if (!cache || !cache->release(chunk)) {
+      Mix_FreeChunk(chunk);
+    }
+  }
+
+  // true when name refers to a sample the background loader has not
+  // merged yet
+  bool sample_loading(std::string const &name) {
+    if (!loader) {
+      return false;
+    }
+    if (loading_files.count(name)) {
+      return true;
+    }
+    if (name == "play" || name == "/play" || name.empty()) {
+      return ordered_chunks.empty();
+    }
+    try {
+      return std::stoul(name) >= ordered_chunks.size();
+    } catch (std::exception &e) {
+      return false;
+    }
+  }
+
+  sequence_t play(std::string const &name, uint64_t start_frame = 0,
+                  play_options const &options = {}) {
+    auto chunk = name_to_chunk(name);
+    if (!chunk) {
+      return 0;
+    }
+    return play(chunk, start_frame, options);
+  }
+
+  bool output_spec(int &frequency, int &channels) {
+    if (mixer) {
+      frequency = mixer->frequency;
+      channels = mixer->channels;
+      return true;
+    }
+    Uint16 format;
+    if (!Mix_QuerySpec(&frequency, &format, &channels)) {
+      log_error("Mix_QuerySpec {}", Mix_GetError());
+      return false;
+    }
+    return true;
+  }
+
+  // renders a string of '.', '-' and ' ' into one buffer, each element
+  // followed by a gap
+  std::unique_ptr<morse_render> render_morse(std::string const &morse) {
+    int frequency, channels;
+    if (!output_spec(frequency, channels)) {
+      return nullptr;
+    }
+    auto dot = load_to_chunk("morse_dot.wav");
+    auto dash = load_to_chunk("morse_dash.wav");
+    auto space = load_to_chunk("morse_space.wav");
+    auto gap = load_to_chunk("morse_gap.wav");
+
+    // the elements go into one buffer, so must share a rate, which the
+    // render is played back at
+    int rate = 0;
+    for (auto chunk : {dot, dash, space, gap}) {
+      if (!chunk) {
+        continue;
+      }
+      auto chunk_rate = frequency;
+      {
+        std::lock_guard<std::mutex> _{chunk_rates_mutex};
+        auto i = chunk_rates.find(chunk);
+        if (i != chunk_rates.end()) {
+          chunk_rate = i->second;
+        }
+      }
+      if (rate && rate != chunk_rate) {
+        log_error("morse samples differ in rate");
+        return nullptr;
+      }
+      rate = chunk_rate;
+    }
+
+    auto render = std::make_unique<morse_render>();
+    render->morse = morse;
+    size_t frame_bytes = sizeof(Sint16) * channels;
+    auto add_chunk = [&](Mix_Chunk *chunk, float brightness = 0) {
+      if (!chunk) {
+        return;
+      }
+      render->timeline.emplace_back(render->pcm.size() / frame_bytes,
+                                    brightness);
+      render->pcm.insert(render->pcm.end(), chunk->abuf,
+                         chunk->abuf + chunk->alen);
+    };
+
+    for (auto const &c : morse) {
+      Mix_Chunk *chunk = nullptr;
+      auto brightness = 0.0f;
+      switch (c) {
+      case '.':
+        chunk = dot;
+        brightness = .9;
+        break;
+      case '-':
+        chunk = dash;
+        brightness = 1.0;
+        break;
+      case ' ':
+        chunk = space;
+        break;
+      }
+      add_chunk(chunk, brightness);
+      add_chunk(gap);
+    }
+    if (render->pcm.empty()) {
+      return nullptr;
+    }
+    render->timeline.emplace_back(render->pcm.size() / frame_bytes, 0);
+    render->frequency = rate;
+    render->chunk.abuf = render->pcm.data();
+    render->chunk.alen = render->pcm.size();
+    render->chunk.volume = MIX_MAX_VOLUME;
+    render->level = peak_level(&render->chunk);
+    return render;
+  }
+
+  // the render for message, from the cache or made with to_morse, which
+  // returns false if the message can't be sent
+  morse_render *
+  morse_render_for(std::string const &message,
+                   std::function<bool(std::string &morse)> const &to_morse) {
+    if (!morse_renders) {
+      morse_renders =
+          std::make_unique<morse_cache>(vm["morse_cache_size"].as<size_t>());
+    }
+    if (auto render = morse_renders->find(message)) {
+      return render;
+    }
+    std::string morse;
+    if (!to_morse(morse)) {
+      return nullptr;
+    }
+    auto render = render_morse(morse);
+    if (!render) {
+      return nullptr;
+    }
+    return morse_renders->insert(message, std::move(render));
+  }
+
+  sequence_t play_morse(morse_render *render) {
+    if (!render) {
+      return 0;
+    }
+    gl_lozenge.lozenge_message = render->morse;
+    gl_rainbow.fire_start = 1;
+    make_fire_server_request(vm["fire_server_start_path"].as<std::string>());
+
+    play_options options;
+    if (mixer) {
+      options.rate = float(render->frequency) / mixer->frequency;
+    }
+    auto sequence = play(&render->chunk, 0, options);
+    if (sequence) {
+      // the laser's edges are all known now, against the audio clock,
+      // and take over from any message still to come
+      auto begin = output_micros(0);
+      if (morse_sequence) {
+        laser.cancel_after(begin, morse_sequence);
+      }
+      for (auto const &step : render->timeline) {
+        laser.schedule(laser_level(step.second),
+                       begin + int64_t(step.first) * 1000000 /
+                                   render->frequency,
+                       sequence);
+      }
+      morse_showing = render;
+      morse_sequence = sequence;
+      morse_started_millis = time_millis();
+      morse_step = 0;
+      show_morse_brightness();
+    }
+    return sequence;
+  }
+
+  // steps the screen through the timeline of the morse playing, on a
+  // timer armed for each change
+  void show_morse_brightness() {
+    if (morse_event_added) {
+      event_del(&morse_event);
+      morse_event_added = false;
+    }
+    if (!morse_showing || !sequences.find(morse_sequence)) {
+      morse_showing = nullptr;
+      return;
+    }
+    auto const &timeline = morse_showing->timeline;
+    auto step_millis = [&](size_t step) {
+      return long(timeline[step].first * 1000 / morse_showing->frequency);
+    };
+    auto elapsed = time_millis() - morse_started_millis;
+    while (timeline.size() > morse_step + 1 &&
+           step_millis(morse_step + 1) <= elapsed) {
+      ++morse_step;
+    }
+    flash_screen(timeline[morse_step].second);
+    if (timeline.size() == morse_step + 1) {
+      morse_showing = nullptr;
+      return;
+    }
+    auto wait = step_millis(morse_step + 1) - elapsed;
+    struct timeval delay;
+    delay.tv_sec = wait / 1000;
+    delay.tv_usec = (wait % 1000) * 1000;
+    event_set(&morse_event, -1, 0,
+              [](evutil_socket_t, short, void *ctx) -> void {
+                static_cast<context *>(ctx)->show_morse_brightness();
+              },
+              this);
+    event_add(&morse_event, &delay);
+    morse_event_added = true;
+  }
+
+  sequence_t play(Mix_Chunk *chunk, uint64_t start_frame = 0,
+                  play_options const &options = {}) {
+    auto sequence = sequences.add(chunk);
+    if (!sequence) {
+      log_warning("No free sequence slot to play {}", chunk);
+      return 0;
+    }
+    sequences.find(sequence)->sequence_start_frame = start_frame;
+    sequences.find(sequence)->sequence_options = options;
+    pin_chunk(chunk);
+    return start_sequence(sequence);
+  }
+
+  bool init_laser() {
+    auto option = vm["gpio_path"];
+    return option.empty() ||
+           laser.open_line(option.as<std::string>(),
+                           vm["gpio_line"].as<int>(),
+                           vm["gpio_off_value"].as<int>());
+  }
+
+  static int laser_level(float brightness) { return brightness > 0.5; }
+
+  // when the output reaches frame on the lockfree mixer's clock, where 0
+  // is the next callback; now without it
+  int64_t output_micros(uint64_t frame) {
+    if (!mixer) {
+      return now_nanos() / 1000;
+    }
+    if (!frame) {
+      frame = mixer->published_frames.load(std::memory_order_acquire);
+    }
+    return mixer->micros_for_frame(frame);
+  }
+
+  void flash_screen(float brightness) {
+    if (vm["flash_screen"].as<bool>()) {
+      background_r = brightness;
+      background_g = brightness;
+      background_b = brightness;
+    }
+  }
+
+  // on the screen now, and on the laser when the output reaches frame,
+  // for sequence
+  void set_brightness(float brightness, uint64_t frame, sequence_t sequence) {
+    flash_screen(brightness);
+    laser.schedule(laser_level(brightness), output_micros(frame), sequence);
+  }
+
+  sequence_t start_sequence(sequence_t sequence) {
+    auto status = sequences.find(sequence);
+    if (!stealer.has_room() && !steal_voice(status->sequence_chunk)) {
+      ++stealer.rejections;
+      log_warning("start_sequence no voice to steal for sequence {}", sequence);
+      sequence_done(sequence);
+      return 0;
+    }
+    auto const &options = status->sequence_options;
+    // only what a request starts straight away is a trigger to time
+    auto received = status->sequence_start_frame ? 0 : request_received_nanos;
+    int channel =
+        mixer ? mixer->start_voice(status->sequence_chunk, sequence,
+                                   status->sequence_start_frame,
+                                   voice_step(status->sequence_chunk,
+                                              options.rate),
+                                   playback_params_for(options), received)
+              : sdl_channels->play(sequence, status->sequence_chunk);
+    if (channel < 0) {
+      log_error("start_sequence {} {} for sequence {}", channel,
+                mixer ? "no free mixer voice" : "no free channel", sequence);
+      ++stealer.rejections;
+      sequence_done(sequence);
+      return 0;
+    } else {
+      if (received) {
+        latency.dispatch_to_start.record(now_nanos() -
+                                         request_dispatched_nanos);
+      }
+      log_info("{} playing {} on channel {}", time_millis(), sequence, channel);
+    }
+
+    set_brightness(status->sequence_brightness,
+                   status->sequence_start_frame, sequence);
+
+    sequences.channel(channel) = sequence;
+    status->sequence_channel = channel;
+    completions_posted.set_busy(true);
+    start_stealable(channel, status->sequence_chunk, options.gain);
+    chain_ahead(sequence);
+    return sequence;
+  }
+
+  void start_stealable(int channel, Mix_Chunk *chunk, float gain) {
+    stealer.start(channel, chunk_priority(chunk),
+                  stealer.policy == voice_stealer::steal_quietest
+                      ? chunk_level(chunk) * gain
+                      : 0);
+  }
+
+  // options as the mixer takes them, in its frames
+  playback_params playback_params_for(play_options const &options) {
+    playback_params params;
+    params.gain_left = options.gain * std::min(1.f, 1 - options.pan);
+    params.gain_right = options.gain * std::min(1.f, 1 + options.pan);
+    params.fade_in_frames =
+        int64_t(options.fade_in_ms) * mixer->frequency / 1000;
+    params.fade_out_frames =
+        int64_t(options.fade_out_ms) * mixer->frequency / 1000;
+    params.loops = options.loops;
+    params.bus = options.bus;
+    return params;
+  }
+
+  // on the libevent thread, whenever chunk goes into chunks under name
+  void weigh_chunk(std::string const &name, Mix_Chunk *chunk) {
+    auto priority = sample_priorities.find(name);
+    chunk_weights[chunk] = {
+        priority == sample_priorities.end() ? 0 : priority->second,
+        stealer.policy == voice_stealer::steal_quietest ? peak_level(chunk)
+                                                        : 0};
+  }
+
+  // morse renders have no name, so no priority
+  int chunk_priority(Mix_Chunk *chunk) {
+    auto i = chunk_weights.find(chunk);
+    return i == chunk_weights.end() ? 0 : i->second.priority;
+  }
+
+  float chunk_level(Mix_Chunk *chunk) {
+    auto i = chunk_weights.find(chunk);
+    if (i != chunk_weights.end()) {
+      return i->second.level;
+    }
+    auto render = morse_renders ? morse_renders->rendered(chunk) : nullptr;
+    return render ? render->level : 0;
+  }
+
+  // fades out a sounding voice to make room for chunk, under the
+  // voice_stealing policy; false if none may be taken
+  bool steal_voice(Mix_Chunk *chunk) {
+    auto victim = stealer.victim(chunk_priority(chunk));
+    if (victim < 0) {
+      return false;
+    }
+    auto sequence = sequences.channel(victim);
+    log_info("{} stealing channel {} from {}", time_millis(), victim, sequence);
+    auto fade_ms = vm["steal_fade_ms"].as<int>();
+    stealer.release(victim);
+    ++stealer.steals;
+    if (mixer) {
+      mixer->stop_voice(victim, sequence,
+                        std::max(1, fade_ms * mixer->frequency / 1000));
+    } else {
+      Mix_FadeOutChannel(victim, fade_ms);
+    }
+    return true;
+  }
+
+  // hands the sequences queued after this one to the mixer before it
+  // ends, so each starts on the sample after its predecessor's last.
+  // Keeps a few buffers chained so completions can be drained in between.
+  void chain_ahead(sequence_t sequence) {
+    if (!mixer) {
+      chain_sdl_channel(sequence);
+      return;
+    }
+    auto status = sequences.find(sequence);
+    size_t frames_ahead = 0;
+    while (status && 4 * mixer->bucket_frames() > frames_ahead) {
+      auto next_sequence = status->next_sequence;
+      auto next = sequences.find(next_sequence);
+      if (!next) {
+        return;
+      }
+      auto const &options = next->sequence_options;
+      auto step = voice_step(next->sequence_chunk, options.rate);
+      if (next->sequence_channel < 0) {
+        auto voice = stealer.has_room()
+                         ? mixer->chain_voice(next->sequence_chunk,
+                                              next_sequence,
+                                              status->sequence_channel,
+                                              sequence, step,
+                                              playback_params_for(options))
+                         : -1;
+        if (voice < 0) {
+          // it starts when this one is done instead
+          return;
+        }
+        sequences.channel(voice) = next_sequence;
+        next->sequence_channel = voice;
+        start_stealable(voice, next->sequence_chunk, options.gain);
+      }
+      if (options.loops < 0) {
+        return; // nothing after it ever plays
+      }
+      frames_ahead +=
+          next->sequence_chunk->alen / (sizeof(Sint16) * mixer->channels) *
+          mixer_engine::unity_step / step * (options.loops + 1);
+      sequence = next_sequence;
+      status = next;
+    }
+  }
+
+  // SDL_mixer can't start a channel on a given sample, so only the
+  // sequence straight after this one is chained, to start from the
+  // channel finished callback as this one ends
+  void chain_sdl_channel(sequence_t sequence) {
+    auto status = sequences.find(sequence);
+    if (!status || status->sequence_channel < 0) {
+      return;
+    }
+    auto next = sequences.find(status->next_sequence);
+    if (!next || next->sequence_channel >= 0 ||
+        next->sequence_chained_channel >= 0) {
+      return;
+    }
+    if (sdl_channels->chain(status->sequence_channel, sequence,
+                            status->next_sequence, next->sequence_chunk)) {
+      next->sequence_chained_channel = status->sequence_channel;
+    }
+  }
+
+  // takes back the chaining of an unplayed sequence; false if the
+  // callback has already started it, on the channel it now has
+  bool unchain_sdl_channel(sequence_t sequence, sequence_status &status) {
+    auto channel = status.sequence_chained_channel;
+    status.sequence_chained_channel = -1;
+    if (channel < 0 || sdl_channels->unchain(channel, sequence)) {
+      return true;
+    }
+    status.sequence_channel = channel;
+    return false;
+  }
+
+  // marks the request about to be handled as received at received_nanos
+  // over how, so any sequence it starts straight away is timed, until it
+  // goes
+  struct timed_request {
+    context &ctx;
+    timed_request(context &ctx_, int64_t received_nanos, transport how)
+        : ctx(ctx_) {
+      auto now = now_nanos();
+      ctx.latency.receive_to_dispatch.record(now - received_nanos);
+      ctx.request_received_nanos = received_nanos;
+      ctx.request_dispatched_nanos = now;
+      ctx.request_transport = how;
+    }
+    ~timed_request() {
+      ctx.request_received_nanos = 0;
+      ctx.request_transport = transport_script;
+    }
+  };
+
+  void write_latency_stats(std::ostream &out) {
+    std::vector<double> const quantiles{0.5, 0.99, 0.999, 1};
+    std::vector<double> nanos;
+    auto write = [&](char const *stage, latency_histogram const &histogram) {
+      auto count = histogram.read(quantiles, nanos);
+      out << stage << " COUNT " << count << " P50_MICROS " << nanos[0] / 1000
+          << " P99_MICROS " << nanos[1] / 1000 << " P999_MICROS "
+          << nanos[2] / 1000 << " MAX_MICROS " << nanos[3] / 1000
+          << std::endl;
+    };
+    write("RECEIVE_TO_DISPATCH", latency.receive_to_dispatch);
+    write("DISPATCH_TO_START", latency.dispatch_to_start);
+    write("START_TO_CALLBACK", latency.start_to_callback);
+    write("RECEIVE_TO_CALLBACK", latency.receive_to_callback);
+    write("MISSED_START", latency.missed_start);
+  }
+
+  // Prometheus text format
+  void write_metrics(std::ostream &out) {
+    auto family = [&](char const *name, char const *type, char const *help) {
+      out << "# HELP audiomixserver_" << name << " " << help << std::endl
+          << "# TYPE audiomixserver_" << name << " " << type << std::endl;
+    };
+    auto sample = [&](char const *name, std::string const &labels,
+                      auto value) {
+      out << "audiomixserver_" << name << (labels.empty() ? "" : "{")
+          << labels << (labels.empty() ? "" : "}") << " " << value
+          << std::endl;
+    };
+    auto summary = [&](char const *name, std::string const &labels,
+                       latency_histogram const &histogram) {
+      std::vector<double> const quantiles{0.5, 0.99, 0.999};
+      std::vector<double> nanos;
+      double sum = 0;
+      auto count = histogram.read(quantiles, nanos, &sum);
+      auto prefix = labels.empty() ? labels : labels + ",";
+      for (size_t q = 0; quantiles.size() > q; ++q) {
+        std::ostringstream quantile;
+        quantile << prefix << "quantile=\"" << quantiles[q] << "\"";
+        sample(name, quantile.str(), nanos[q] / 1e9);
+      }
+      out << "audiomixserver_" << name << "_sum"
+          << (labels.empty() ? "" : "{" + labels + "}") << " " << sum / 1e9
+          << std::endl
+          << "audiomixserver_" << name << "_count"
+          << (labels.empty() ? "" : "{" + labels + "}") << " " << count
+          << std::endl;
+    };
+
+    family("requests_total", "counter", "Requests by command and transport");
+    for (size_t c = 0; metric_command_count > c; ++c) {
+      for (int t = 0; transport_count > t; ++t) {
+        if (auto n = metrics.sum(metric_requests + c * transport_count + t)) {
+          sample("requests_total",
+                 std::string("command=\"") + metric_commands[c] +
+                     "\",transport=\"" + transport_names[t] + "\"",
+                 n);
+        }
+      }
+    }
+
+    family("voices", "gauge", "Voices sounding");
+    sample("voices", "", stealer.sounding);
+    family("voice_limit", "gauge", "Voices that can sound at once");
+    sample("voice_limit", "", stealer.voice_limit);
+    family("voice_steals_total", "counter",
+           "Voices faded out to make room for a new sequence");
+    sample("voice_steals_total", "", stealer.steals);
+    family("voice_rejections_total", "counter",
+           "Sequences that failed for want of a voice");
+    sample("voice_rejections_total", "", stealer.rejections);
+
+    {
+      size_t playing = 0, queued = 0;
+      for (auto const &slot : sequences.slots) {
+        if (slot.slot_sequence) {
+          ++(slot.slot_status.sequence_channel >= 0 ? playing : queued);
+        }
+      }
+      family("sequences", "gauge", "Sequences playing or waiting to");
+      sample("sequences", "state=\"playing\"", playing);
+      sample("sequences", "state=\"queued\"", queued);
+
+      if (budget) {
+        family("sample_resident_bytes", "gauge", "Bytes of decoded samples");
+        sample("sample_resident_bytes", "", budget->resident_bytes);
+        family("sample_budget_bytes", "gauge",
+               "Bytes of decoded samples allowed");
+        sample("sample_budget_bytes", "", budget->budget_bytes);
+        family("sample_hits_total", "counter",
+               "Plays of samples already decoded");
+        sample("sample_hits_total", "", budget->hits);
+        family("sample_misses_total", "counter",
+               "Plays that decoded their sample first");
+        sample("sample_misses_total", "", budget->misses);
+        family("sample_evictions_total", "counter",
+               "Samples freed to keep within the budget");
+        sample("sample_evictions_total", "", budget->evictions);
+        family("sample_decode_seconds_total", "counter",
+               "Time spent decoding samples on first play");
+        sample("sample_decode_seconds_total", "",
+               budget->decode_millis_total / 1000);
+      }
+    }
+
+    if (mixer) {
+      family("callbacks_total", "counter", "Audio callbacks mixed");
+      sample("callbacks_total", "", metrics.sum(metric_callbacks));
+      family("callback_overruns_total", "counter",
+             "Audio callbacks that took longer than the audio they mixed");
+      sample("callback_overruns_total", "",
+             metrics.sum(metric_callback_overruns));
+      family("underruns_total", "counter",
+             "Audio callbacks late enough that the device likely ran dry");
+      sample("underruns_total", "", metrics.sum(metric_underruns));
+      family("callback_duration_seconds", "summary",
+             "Time spent in each audio callback");
+      summary("callback_duration_seconds", "", mixer->callback_duration);
+    }
+
+    family("trigger_latency_seconds", "summary",
+           "Time from a request arriving to its sequence starting, by stage");
+    summary("trigger_latency_seconds", "stage=\"receive_to_dispatch\"",
+            latency.receive_to_dispatch);
+    summary("trigger_latency_seconds", "stage=\"dispatch_to_start\"",
+            latency.dispatch_to_start);
+    summary("trigger_latency_seconds", "stage=\"start_to_callback\"",
+            latency.start_to_callback);
+    summary("trigger_latency_seconds", "stage=\"receive_to_callback\"",
+            latency.receive_to_callback);
+    family("missed_start_seconds", "summary",
+           "Scheduled sequences dropped for reaching the mixer after their "
+           "start time, by how long after");
+    summary("missed_start_seconds", "", latency.missed_start);
+
+    family("udp_batch_size", "histogram", "Datagrams received at once");
+    uint64_t below = 0;
+    for (int b = 0; udp_batch_buckets > b; ++b) {
+      below += metrics.sum(metric_udp_batch_size + b);
+      auto le = udp_batch_buckets - 1 > b ? std::to_string(1 << b) : "+Inf";
+      sample("udp_batch_size_bucket", "le=\"" + le + "\"", below);
+    }
+    sample("udp_batch_size_sum", "", metrics.sum(metric_udp_datagrams));
+    sample("udp_batch_size_count", "", metrics.sum(metric_udp_batches));
+
+    family("fire_requests_total", "counter",
+           "Fire server requests by outcome; sent counts each attempt");
+    std::pair<char const *, uint64_t> const fire_outcomes[] = {
+        {"sent", fire.sent},           {"ok", fire.succeeded},
+        {"failed", fire.failed},       {"retried", fire.retried},
+        {"coalesced", fire.coalesced}, {"dropped", fire.dropped}};
+    for (auto const &outcome : fire_outcomes) {
+      sample("fire_requests_total",
+             std::string("outcome=\"") + outcome.first + "\"",
+             outcome.second);
+    }
+    family("fire_request_duration_seconds", "summary",
+           "Time from sending a fire server request to its reply or failure");
+    summary("fire_request_duration_seconds", "", fire.durations);
+
+    family("log_dropped_total", "counter",
+           "Log messages dropped because a thread's log ring was full");
+    sample("log_dropped_total", "", logger.dropped.load());
+  }
+
+  void handle_http_request(evhttp_request *req) {
+    auto received = now_nanos();
+    char *address;
+    ev_uint16_t port;
+    struct evhttp_connection *con = evhttp_request_get_connection(req);
+    evhttp_connection_get_peer(con, &address, &port);
+
+    auto uri = evhttp_request_get_evhttp_uri(req);
+
+    auto path = std::string(evhttp_uri_get_path(uri));
+    log_info("Received HTTP request from {}:{} for {}", address, port, path);
+    std::ostringstream out;
+
+    bool success = true;
+    if ("/metrics" == path) {
+      // a scraper wants nothing but the metrics
+      count_request("metrics", transport_http);
+      write_metrics(out);
+      evhttp_add_header(evhttp_request_get_output_headers(req),
+                        "Content-Type", "text/plain; version=0.0.4");
+    } else {
+      timed_request _{*this, received, transport_http};
+      success = handle_request(out, uri);
+    }
+    enforce_sample_budget();
+
+    auto *buf = evhttp_request_get_output_buffer(req);
+    if (!buf) {
+      log_error("evhttp_request_get_output_buffer");
+      return;
+    }
+    auto str = out.str();
+    if (evbuffer_add(buf, str.data(), str.length())) {
+      log_error("evbuffer_add");
+      return;
+    }
+
+    evhttp_send_reply(req, success ? HTTP_OK : 500, "Rock on", buf);
+  }
+
+  void handle_udp_events(evutil_socket_t sock) {
+#ifdef __linux__
+    if (batch) {
+      handle_udp_batches(sock);
+      return;
+    }
+#endif
+    struct sockaddr_storage addr;
+    char buf[1 << 16];
+    for (;;) {
+      socklen_t addr_len = sizeof(addr);
+      auto bytes = recvfrom(sock, buf, sizeof(buf), 0, (struct sockaddr *)&addr,
+                            &addr_len);
+      if (bytes < 0) {
+        return;
+      }
+      auto received = now_nanos();
+      count_udp_batch(1);
+
+      if (is_binary_udp_request(buf, bytes)) {
+        char reply[binary_message_size];
+        auto reply_len = handle_binary_udp_request(buf, bytes, &addr,
+                                                   addr_len, reply, received);
+        send_udp_reply(sock, reply, reply_len, &addr, addr_len);
+      } else {
+        auto msg = handle_udp_request(std::string(buf, bytes), &addr,
+                                      addr_len, received);
+        send_udp_reply(sock, msg.data(), msg.size(), &addr, addr_len);
+      }
+    }
+  }
+
+#ifdef __linux__
+  void handle_udp_batches(evutil_socket_t sock) {
+    auto &b = *batch;
+    for (;;) {
+      b.prepare_receive();
+      auto received =
+          recvmmsg(sock, b.messages.data(), b.batch_size, MSG_DONTWAIT, nullptr);
+      if (received <= 0) {
+        return;
+      }
+      count_udp_batch(received);
+
+      unsigned replies = 0;
+      for (unsigned i = 0; unsigned(received) > i; ++i) {
+        auto buf = b.buffer(i);
+        auto len = b.messages[i].msg_len;
+        auto addr = &b.addrs[i];
+        auto addr_len = b.messages[i].msg_hdr.msg_namelen;
+        auto received = b.received_nanos(i);
+        if (is_binary_udp_request(buf, len)) {
+          auto reply = b.binary_replies[i].data();
+          if (auto reply_len = handle_binary_udp_request(
+                  buf, len, addr, addr_len, reply, received)) {
+            b.add_reply(replies++, i, reply, reply_len);
+          }
+        } else {
+          auto &reply = b.text_replies[i];
+          reply = handle_udp_request(std::string(buf, len), addr, addr_len,
+                                     received);
+          if (!reply.empty()) {
+            b.add_reply(replies++, i, reply.data(), reply.size());
+          }
+        }
+      }
+
+      send_udp_replies(sock, b, replies);
+
+      if (unsigned(received) < b.batch_size) {
+        return;
+      }
+    }
+  }
+
+  void send_udp_replies(evutil_socket_t sock, udp_batch &b,
+                        unsigned replies) {
+    unsigned dropped = 0;
+    int error = 0;
+    for (unsigned sent = 0; replies > sent;) {
+      auto n = sendmmsg(sock, b.reply_messages.data() + sent, replies - sent,
+                        0);
+      if (n <= 0) {
+        // the first message left failed, e.g. to an unreachable
+        // address; the rest may well go
+        error = EVUTIL_SOCKET_ERROR();
+        ++dropped;
+        ++sent;
+        continue;
+      }
+      sent += n;
+    }
+    if (dropped) {
+      log_error("sendmmsg {} dropped {} of {} replies",
+                evutil_socket_error_to_string(error), dropped, replies);
+    }
+  }
+#endif
+
+  void send_udp_reply(evutil_socket_t sock, char const *msg, size_t len,
+                      const void *addr, int addr_len) {
+    if (!len) {
+      return;
+    }
+    if (sendto(sock, msg, len, 0, static_cast<const sockaddr *>(addr),
+               addr_len) != ssize_t(len)) {
+      log_error("sendto {}",
+                evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR()));
+    }
+  }
+
+  // key for binary_client_tokens that needs no formatting
+  static uint64_t remote_key(const void *addr) {
+    switch (static_cast<const sockaddr *>(addr)->sa_family) {
+    case AF_INET: {
+      auto sa = static_cast<const sockaddr_in *>(addr);
+      return uint64_t(sa->sin_addr.s_addr) << 16 | sa->sin_port;
+    }
+    case AF_INET6: {
+      auto sa = static_cast<const sockaddr_in6 *>(addr);
+      return fnv1a_64(&sa->sin6_port, sizeof(sa->sin6_port),
+                      fnv1a_64(&sa->sin6_addr, sizeof(sa->sin6_addr)));
+    }
+    default:
+      return 0;
+    }
+  }
+
+  static std::string remote_address(const void *addr, int addr_len) {
+    switch (static_cast<const sockaddr *>(addr)->sa_family) {
+    case AF_INET: {
+      char namebuf[INET_ADDRSTRLEN];
+      auto sa = static_cast<const sockaddr_in *>(addr);
+      if (!evutil_inet_ntop(AF_INET, &sa->sin_addr, namebuf, sizeof(namebuf))) {
+        log_error("evutil_inet_ntop AF_INET {}",
+                  evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR()));
+        return "<UNKNOWN-IPv4>";
+      }
+
+      return std::string(namebuf) + ":" + std::to_string(ntohs(sa->sin_port));
+    }
+    case AF_INET6: {
+      char namebuf[INET6_ADDRSTRLEN];
+      auto sa = static_cast<const sockaddr_in6 *>(addr);
+      if (!evutil_inet_ntop(AF_INET6, &sa->sin6_addr, namebuf,
+                            sizeof(namebuf))) {
+        log_error("evutil_inet_ntop AF_INET6 {}",
+                  evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR()));
+        return "<UNKNOWN-IPv6>";
+      }
+
+      return std::string(namebuf) + ":" + std::to_string(ntohs(sa->sin6_port));
+    }
+    default:
+      return "<UNKNOWN-AF>";
+    }
+  }
+
+  void stop(sequence_t sequence) {
+    auto status = sequences.find(sequence);
+    if (!status) {
+      return;
+    }
+    if (status->sequence_channel < 0 &&
+        (mixer || unchain_sdl_channel(sequence, *status))) {
+      if (status->next_sequence) {
+        log_error("Unplayed sequence {} has next sequence {}", sequence,
+                  status->next_sequence);
+      }
+
+      unpin_chunk(status->sequence_chunk);
+      sequences.erase(sequence);
+    } else if (mixer) {
+      mixer->stop_voice(status->sequence_channel, sequence,
+                        playback_params_for(status->sequence_options)
+                            .fade_out_frames);
+    } else {
+      sdl_channels->halt(status->sequence_channel, sequence);
+    }
+  }
+
+  enum class queue_outcome { queued, wait, playing, failed };
+
+  // queues chunk to play when sequence after finishes, replacing whatever
+  // was queued there before; plays it at start_frame if after is unknown
+  queue_outcome queue(sequence_t after, Mix_Chunk *chunk, sequence_t &seq,
+                      uint64_t start_frame = 0,
+                      play_options const &options = {}) {
+    bool found = false;
+    {
+      auto status = sequences.find(after);
+      if (status) {
+        found = true;
+        if (status->sequence_channel >= 0) {
+          auto replaced = sequences.find(status->next_sequence);
+          if (replaced &&
+              (replaced->sequence_channel >= 0 ||
+               (!mixer &&
+                !unchain_sdl_channel(status->next_sequence, *replaced)))) {
+            // already chained; it is done once stopped
+            stop(status->next_sequence);
+          } else {
+            sequence_done(status->next_sequence);
+          }
+          status->next_sequence = seq = sequences.add(chunk);
+          if (!seq) {
+            return queue_outcome::failed;
+          }
+          sequences.find(seq)->sequence_options = options;
+          pin_chunk(chunk);
+          chain_ahead(after);
+        }
+      }
+    }
+    if (seq) {
+      return queue_outcome::queued;
+    } else if (found) {
+      return queue_outcome::wait;
+    } else if ((seq = play(chunk, start_frame, options))) {
+      return queue_outcome::playing;
+    } else {
+      return queue_outcome::failed;
+    }
+  }
+
+  // reads a TIME style timestamp into the output frame it falls on;
+  // false with the reason written to out if it can't be honoured
+  bool scheduled_frame(std::string const &at, uint64_t &frame,
+                       std::ostream &out) {
+    int64_t micros;
+    if (!parse_time_micros(at, micros)) {
+      out << "BAD TIME " << at << std::endl;
+      return false;
+    }
+    if (!mixer) {
+      out << "SCHEDULING NEEDS LOCKFREE MIXER" << std::endl;
+      return false;
+    }
+    int64_t late_micros;
+    if (!mixer->frame_for_time(micros, frame, late_micros)) {
+      out << "LATE " << late_micros << std::endl;
+      return false;
+    }
+    return true;
+  }
+
+  // reads the rate, gain, pan, fade_in_ms, fade_out_ms and loop
+  // parameters given into options; false with the reason written to out
+  // if one is out of range or needs the lockfree mixer
+  bool parse_play_options(std::unordered_map<std::string, std::string> &params,
+                          play_options &options, std::ostream &out) {
+    auto read = [&](char const *name, double lowest, double highest,
+                    auto &value) {
+      auto before = value;
+      if (!read_param(params, name, lowest, highest, value, out)) {
+        return false;
+      }
+      if (!mixer && value != before) {
+        out << upper_case(name) << " NEEDS LOCKFREE MIXER" << std::endl;
+        return false;
+      }
+      return true;
+    };
+    auto const &bus = params["bus"];
+    if (!bus.empty()) {
+      options.bus = bus_index(bus);
+      if (options.bus < 0) {
+        out << "NO BUS " << bus << std::endl;
+        return false;
+      }
+    }
+    return read("rate", 1 / 16., 16, options.rate) &&
+           read("gain", 0, 16, options.gain) &&
+           read("pan", -1, 1, options.pan) &&
+           read("fade_in_ms", 0, 600000, options.fade_in_ms) &&
+           read("fade_out_ms", 0, 600000, options.fade_out_ms) &&
+           read("loop", -1, 1000000, options.loops);
+  }
+
+  // -1 if there is no bus called name
+  int bus_index(std::string const &name) const {
+    auto i = std::find(bus_names.begin(), bus_names.end(), name);
+    if (i == bus_names.end() || !buses.count(name)) {
+      return -1;
+    }
+    return i - bus_names.begin();
+  }
+
+  // reads the set_bus parameters given into settings
+  bool parse_bus_settings(std::unordered_map<std::string, std::string> &params,
+                          std::string const &name, bus_settings &settings,
+                          std::ostream &out) {
+    if (!params["parent"].empty()) {
+      if ("master" == name) {
+        out << "MASTER HAS NO PARENT" << std::endl;
+        return false;
+      }
+      settings.parent = params["parent"];
+    }
+    if (!params["eq"].empty()) {
+      settings.eq = params["eq"];
+    }
+    // send=reverb:0.3,delay:0.1 or send=none
+    auto const &send = params["send"];
+    if (!send.empty()) {
+      settings.sends.clear();
+      std::istringstream iss{send};
+      std::string item;
+      while ("none" != send && std::getline(iss, item, ',')) {
+        auto colon = item.rfind(':');
+        char *end = nullptr;
+        float level = colon == std::string::npos
+                          ? -1
+                          : std::strtof(item.c_str() + colon + 1, &end);
+        if (!end || *end || !(level >= 0 && 16 >= level)) {
+          out << "BAD SEND " << item << std::endl;
+          return false;
+        }
+        settings.sends.emplace_back(item.substr(0, colon), level);
+      }
+    }
+    return read_param(params, "gain", 0, 16, settings.gain, out) &&
+           read_param(params, "eq_freq", 10, mixer->frequency * 0.49,
+                      settings.eq_freq, out) &&
+           read_param(params, "eq_q", 0.1, 20, settings.eq_q, out) &&
+           read_param(params, "eq_gain_db", -48, 48, settings.eq_gain_db,
+                      out) &&
+           read_param(params, "compress_threshold_db", -96, 0,
+                      settings.compress_threshold_db, out) &&
+           read_param(params, "compress_ratio", 1, 1000,
+                      settings.compress_ratio, out) &&
+           read_param(params, "compress_attack_ms", 0.1, 1000,
+                      settings.compress_attack_ms, out) &&
+           read_param(params, "compress_release_ms", 1, 10000,
+                      settings.compress_release_ms, out) &&
+           read_param(params, "makeup_db", -24, 48, settings.makeup_db, out);
+  }
+
+  // compiles buses into a graph and swaps it into the mixer, or writes
+  // why it can't be
+  bool publish_buses(std::ostream &out) {
+    auto graph = std::make_unique<bus_graph>();
+    auto count = bus_names.size();
+    graph->buses.resize(count);
+    // the buses each bus adds into
+    std::vector<std::vector<int>> feeds(count);
+    size_t present = 0;
+    for (size_t b = 0; count > b; ++b) {
+      auto i = buses.find(bus_names[b]);
+      if (i == buses.end()) {
+        continue;
+      }
+      ++present;
+      auto const &settings = i->second;
+      auto &bus = graph->buses[b];
+      bus.bus_present = true;
+      bus.bus_gain = settings.gain;
+      if (b) {
+        bus.bus_parent = bus_index(settings.parent);
+        if (bus.bus_parent < 0) {
+          out << "NO BUS " << settings.parent << std::endl;
+          return false;
+        }
+        feeds[b].push_back(bus.bus_parent);
+      }
+      if ("none" != settings.eq) {
+        if (!design_biquad(settings.eq, settings.eq_freq, settings.eq_q,
+                           settings.eq_gain_db, mixer->frequency,
+                           bus.bus_eq)) {
+          out << "BAD EQ " << settings.eq << std::endl;
+          return false;
+        }
+        bus.bus_filtered = true;
+      }
+      for (auto const &send : settings.sends) {
+        auto to = bus_index(send.first);
+        if (to < 0) {
+          out << "NO BUS " << send.first << std::endl;
+          return false;
+        }
+        bus.bus_sends.emplace_back(to, send.second);
+        feeds[b].push_back(to);
+      }
+      auto coefficient = [&](float ms) {
+        return float(1 - std::exp(-1000. * mixer_engine::compressor_frames /
+                                  (ms * mixer->frequency)));
+      };
+      bus.compress_threshold = std::pow(10, settings.compress_threshold_db / 20);
+      bus.compress_ratio = settings.compress_ratio;
+      bus.compress_attack = coefficient(settings.compress_attack_ms);
+      bus.compress_release = coefficient(settings.compress_release_ms);
+      bus.compress_makeup = std::pow(10, settings.makeup_db / 20);
+    }
+
+    // each bus runs once all those feeding it have
+    std::vector<int> feeding(count);
+    for (auto const &targets : feeds) {
+      for (auto to : targets) {
+        ++feeding[to];
+      }
+    }
+    std::vector<int> ready;
+    for (size_t b = 0; count > b; ++b) {
+      if (graph->buses[b].bus_present && !feeding[b]) {
+        ready.push_back(b);
+      }
+    }
+    while (!ready.empty()) {
+      auto b = ready.back();
+      ready.pop_back();
+      graph->bus_order.push_back(b);
+      for (auto to : feeds[b]) {
+        if (!--feeding[to]) {
+          ready.push_back(to);
+        }
+      }
+    }
+    if (graph->bus_order.size() != present) {
+      out << "BUS CYCLE" << std::endl;
+      return false;
+    }
+    mixer->set_graph(std::move(graph));
+    return true;
+  }
+
+  bool set_bus(std::string const &name, bus_settings const &settings,
+               std::ostream &out) {
+    auto previous = buses;
+    bool added = bus_names.end() ==
+                 std::find(bus_names.begin(), bus_names.end(), name);
+    if (added) {
+      if (bus_names.size() >= size_t(mixer_engine::max_buses)) {
+        out << "BUS LIMIT" << std::endl;
+        return false;
+      }
+      bus_names.push_back(name);
+    }
+    buses[name] = settings;
+    if (!publish_buses(out)) {
+      buses = previous;
+      if (added) {
+        bus_names.pop_back();
+      }
+      return false;
+    }
+    out << "BUS " << name << std::endl;
+    return true;
+  }
+
+  // the buses feeding name go to the master instead; voices routed to
+  // it go to the master until it is set again
+  bool remove_bus(std::string const &name, std::ostream &out) {
+    if ("master" == name || !buses.count(name)) {
+      out << "NO BUS " << name << std::endl;
+      return false;
+    }
+    buses.erase(name);
+    for (auto &pair : buses) {
+      auto &settings = pair.second;
+      if (settings.parent == name) {
+        settings.parent = "master";
+      }
+      settings.sends.erase(
+          std::remove_if(settings.sends.begin(), settings.sends.end(),
+                         [&](std::pair<std::string, float> const &send) {
+                           return send.first == name;
+                         }),
+          settings.sends.end());
+    }
+    if (!publish_buses(out)) {
+      return false;
+    }
+    out << "REMOVED " << name << std::endl;
+    return true;
+  }
+
+  // one line per bus in the form set_bus takes
+  void write_buses(std::ostream &out) {
+    out << "BUSES " << buses.size() << std::endl;
+    for (auto const &name : bus_names) {
+      auto i = buses.find(name);
+      if (i == buses.end()) {
+        continue;
+      }
+      auto const &settings = i->second;
+      out << "name=" << name;
+      if ("master" != name) {
+        out << "&parent=" << settings.parent;
+      }
+      out << "&gain=" << settings.gain << "&eq=" << settings.eq
+          << "&eq_freq=" << settings.eq_freq << "&eq_q=" << settings.eq_q
+          << "&eq_gain_db=" << settings.eq_gain_db << "&send=";
+      if (settings.sends.empty()) {
+        out << "none";
+      }
+      for (auto const &send : settings.sends) {
+        out << (&send == &settings.sends.front() ? "" : ",") << send.first
+            << ":" << send.second;
+      }
+      out << "&compress_threshold_db=" << settings.compress_threshold_db
+          << "&compress_ratio=" << settings.compress_ratio
+          << "&compress_attack_ms=" << settings.compress_attack_ms
+          << "&compress_release_ms=" << settings.compress_release_ms
+          << "&makeup_db=" << settings.makeup_db << std::endl;
+    }
+  }
+
+  // the wall clock, or when rendering offline the time of the next
+  // frame to be mixed
+  timeval request_time() {
+    timeval tv;
+    if (mixer && mixer->virtual_clock) {
+      auto micros = mixer->published_frames.load(std::memory_order_acquire) *
+                    1000000 / mixer->frequency;
+      tv.tv_sec = micros / 1000000;
+      tv.tv_usec = micros % 1000000;
+    } else if (evutil_gettimeofday(&tv, nullptr) < 0) {
+      log_error("evutil_gettimeofday {}",
+                evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR()));
       std::memset(&tv, 0, sizeof(tv));
     }
+    return tv;
+  }
+
+  bool handle_request(std::ostream &out, evhttp_uri const *uri) {
+    auto tv = request_time();
 
     auto path = evhttp_uri_get_path(uri);
     while (path && *path == '/')
       ++path;
     auto cmd = std::string(path);
+    count_request(cmd, request_transport);
     auto params = uri_params(uri);
     auto get_sequence = [&]() -> sequence_t {
       try {
         return std::stoull(params["sequence"]);
       } catch (std::exception &e) {
-        std::cerr << "Parse failed for " << path << ": " << e.what()
-                  << std::endl;
+        log_error("Parse failed for {}: {}", path, e.what());
         out << "NO SEQUENCE " << path << std::endl;
         return 0;
       }
     };
 
-    out << "TIME " << tv.tv_sec << "." << std::setw(5) << std::setfill('0')
+    out << "TIME " << tv.tv_sec << "." << std::setw(6) << std::setfill('0')
         << tv.tv_usec << std::endl;
+    // the frame to play at, or 0 for straight away
+    uint64_t start_frame = 0;
+    auto schedule = [&] {
+      return params["at"].empty() ||
+             scheduled_frame(params["at"], start_frame, out);
+    };
+    play_options options;
     if ("ping" == cmd || "reset" == cmd) {
       out << "PONG" << std::endl << params["payload"] << std::endl;
       return true;
     } else if ("stop" == cmd) {
-      auto sequence = get_sequence();
-      {
-        lock_sdl_audio _;
-        auto i = sequence_to_status.find(sequence);
-        if (i != sequence_to_status.end()) {
-          if (i->second.sequence_channel < 0) {
-            if (i->second.next_sequence) {
-              std::cerr << "Unplayed sequence " << i->first
-                        << " has next sequence " << i->second.next_sequence
-                        << std::endl;
-            }
-
-            sequence_to_status.erase(i);
-          } else {
-            Mix_HaltChannel(i->second.sequence_channel);
-          }
-        }
-      }
+      stop(get_sequence());
       out << "STOPPED" << std::endl;
       return true;
     } else if ("queue" == cmd) {
       auto sequence = get_sequence();
-      if (!sequence) {
+      if (!sequence || !schedule() ||
+          !parse_play_options(params, options, out)) {
         return false;
       }
       auto chunk = name_to_chunk(params["sample"]);
       if (!chunk) {
-        out << "NO SAMPLE" << std::endl;
+        out << (sample_loading(params["sample"]) ? "LOADING" : "NO SAMPLE")
+            << std::endl;
         return false;
       }
 
       sequence_t seq = 0;
-      bool found = false;
-
-      {
-        lock_sdl_audio _;
-        auto i = sequence_to_status.find(sequence);
-        if (i != sequence_to_status.end()) {
-          found = true;
-          if (i->second.sequence_channel >= 0) {
-            sequence_done(i->second.next_sequence);
-            i->second.next_sequence = seq = fresh_sequence_number();
-            sequence_to_status.emplace(seq, sequence_status{chunk});
-          }
-        }
-      }
-      if (seq) {
+      switch (queue(sequence, chunk, seq, start_frame, options)) {
+      case queue_outcome::queued:
         out << "QUEUED " << seq << std::endl;
         return true;
-      } else if (found) {
+      case queue_outcome::wait:
         out << "WAIT" << std::endl;
         return true;
-      } else if (auto s = play(chunk)) {
-        out << "PLAYING " << s << std::endl;
+      case queue_outcome::playing:
+        out << "PLAYING " << seq << std::endl;
         return true;
-      } else {
-        out << "FAILED" << std::endl;
+      case queue_outcome::failed:
+        break;
+      }
+      out << "FAILED" << std::endl;
+      return false;
+    } else if ("set" == cmd) {
+      auto sequence = get_sequence();
+      if (!sequence) {
+        return false;
+      }
+      auto status = sequences.find(sequence);
+      if (!status) {
+        out << "NOT PLAYING " << sequence << std::endl;
         return false;
       }
+      options = status->sequence_options;
+      if (!parse_play_options(params, options, out)) {
+        return false;
+      }
+      status->sequence_options = options;
+      if (mixer && status->sequence_channel >= 0) {
+        mixer->set_voice(status->sequence_channel, sequence,
+                         voice_step(status->sequence_chunk, options.rate),
+                         playback_params_for(options));
+      }
+      out << "SET " << sequence << std::endl;
+      return true;
+    } else if ("set_bus" == cmd) {
+      auto name = params["name"];
+      if (!mixer) {
+        out << "BUSES NEED LOCKFREE MIXER" << std::endl;
+        return false;
+      }
+      if (name.empty()) {
+        out << "NO NAME" << std::endl;
+        return false;
+      }
+      auto settings = buses.count(name) ? buses[name] : bus_settings{};
+      return parse_bus_settings(params, name, settings, out) &&
+             set_bus(name, settings, out);
+    } else if ("remove_bus" == cmd) {
+      return remove_bus(params["name"], out);
+    } else if ("buses" == cmd) {
+      write_buses(out);
+      return true;
     } else if ("songs" == cmd) {
       out << "SONGS " << ordered_chunks.size() << std::endl;
       for (auto const &pair : chunks) {
@@ -878,31 +5636,89 @@ struct context {
             << "</a><br/>" << std::endl;
       }
       return true;
+    } else if ("sample_stats" == cmd) {
+      if (!budget) {
+        out << "NO SAMPLE BUDGET" << std::endl;
+        return true;
+      }
+      budget->write_stats(out);
+      return true;
+    } else if ("voice_stats" == cmd) {
+      out << "VOICES " << stealer.sounding << " LIMIT " << stealer.voice_limit
+          << " STEALS " << stealer.steals << " REJECTIONS "
+          << stealer.rejections << std::endl;
+      return true;
+    } else if ("udp_stats" == cmd) {
+      auto batches = metrics.sum(metric_udp_batches);
+      auto datagrams = metrics.sum(metric_udp_datagrams);
+      out << "UDP_BATCHES " << batches << " DATAGRAMS " << datagrams
+          << " AVERAGE_FILL " << (batches ? double(datagrams) / batches : 0)
+          << std::endl;
+      return true;
+    } else if ("stats" == cmd) {
+      write_latency_stats(out);
+      return true;
+    } else if ("metrics" == cmd) {
+      write_metrics(out);
+      return true;
+    } else if ("fire_stats" == cmd) {
+      size_t in_flight = 0;
+      for (auto const &connection : fire.connections) {
+        in_flight += connection->busy;
+      }
+      out << "FIRE SENT " << fire.sent << " OK " << fire.succeeded
+          << " FAILED " << fire.failed << " RETRIED " << fire.retried
+          << " COALESCED " << fire.coalesced << " DROPPED " << fire.dropped
+          << " IN_FLIGHT " << in_flight << " WAITING " << fire.waiting.size()
+          << std::endl;
+      return true;
+    } else if ("log_level" == cmd) {
+      auto level = params["level"];
+      if (!level.empty()) {
+        auto name = std::find(std::begin(log_level_names),
+                              std::end(log_level_names), level);
+        if (std::end(log_level_names) == name) {
+          out << "BAD LEVEL " << level << std::endl;
+          return false;
+        }
+        log_threshold = name - std::begin(log_level_names);
+      }
+      out << "LOG_LEVEL " << log_level_names[log_threshold] << std::endl;
+      return true;
     } else if ("song_count" == cmd) {
       out << "SONGS " << ordered_chunks.size() << std::endl;
       return true;
     } else if ("play_morse_message" == cmd) {
       auto message_text = params["message"];
-      std::ostringstream oss;
-      bool first = true;
-      for (auto &c : message_text) {
-        if (!first) {
-          oss << " ";
-        } else {
-          first = false;
-        }
+      bool unknown = false;
+      auto render = morse_render_for(message_text, [&](std::string &morse) {
+        std::ostringstream oss;
+        bool first = true;
+        for (auto &c : message_text) {
+          if (!first) {
+            oss << " ";
+          } else {
+            first = false;
+          }
 
-        auto m = character_to_morse.find(std::toupper(c));
-        if (character_to_morse.end() == m) {
-          out << "UNKNOWN CHARACTER" << std::endl;
-          return false;
-        } else {
-          oss << m->second;
+          auto m = character_to_morse.find(std::toupper(c));
+          if (character_to_morse.end() == m) {
+            unknown = true;
+            return false;
+          } else {
+            oss << m->second;
+          }
         }
+        morse = oss.str();
+        log_info("sending morse code {}", morse);
+        return true;
+      });
+      if (unknown) {
+        out << "UNKNOWN CHARACTER" << std::endl;
+        return false;
       }
-      std::cout << "sending morse code " << oss.str() << std::endl;
 
-      auto s = play_morse(oss.str());
+      auto s = play_morse(render);
       out << "PLAYING " << s << std::endl;
       return true;
     } else {
@@ -910,18 +5726,176 @@ struct context {
       if (sample.empty()) {
         sample = evhttp_uri_get_path(uri);
       }
-      if (auto sequence = play(sample)) {
-        out << "PLAYING " << sequence << std::endl;
-        return true;
+      if (!schedule() || !parse_play_options(params, options, out)) {
+        return false;
+      }
+      if (auto sequence = play(sample, start_frame, options)) {
+        out << "PLAYING " << sequence << std::endl;
+        return true;
+      } else if (sample_loading(sample)) {
+        out << "LOADING" << std::endl;
+        return false;
+      } else {
+        out << "FAILED" << std::endl;
+        return false;
+      }
+    }
+  }
+
+  static bool is_binary_udp_request(char const *buf, size_t len) {
+    return len >= sizeof(binary_protocol_magic) &&
+           std::equal(std::begin(binary_protocol_magic),
+                      std::end(binary_protocol_magic), buf);
+  }
+
+  static size_t binary_reply(char *reply, uint64_t token,
+                             binary_status status, uint64_t value) {
+    timeval tv;
+    if (evutil_gettimeofday(&tv, nullptr) < 0) {
+      std::memset(&tv, 0, sizeof(tv));
+    }
+
+    std::memset(reply, 0, binary_message_size);
+    std::copy(std::begin(binary_protocol_magic),
+              std::end(binary_protocol_magic), reply);
+    reply[3] = binary_protocol_version;
+    reply[4] = status;
+    store_be64(reply + 8, token);
+    store_be64(reply + 16, value);
+    store_be64(reply + 24, uint64_t(tv.tv_sec) * 1000000 + tv.tv_usec);
+    return binary_message_size;
+  }
+
+  // validates the request and checks its client token against tokens.
+  // Returns true when it should be executed; otherwise reply_len is the
+  // length of any reply to send straight away. Touches nothing but
+  // tokens, so it can run on any thread.
+  static bool parse_binary_udp_request(
+      char const *buf, size_t len, const void *addr,
+      std::unordered_map<uint64_t, uint64_t> &tokens, binary_request &request,
+      char *reply, size_t &reply_len) {
+    reply_len = 0;
+    if (len < binary_message_size) {
+      log_warning("Short binary UDP request {} bytes", len);
+      return false;
+    }
+    request.command = uint8_t(buf[4]);
+    request.token = load_be(buf + 8, 8);
+    request.sequence = load_be(buf + 16, 8);
+    request.index = load_be(buf + 24, 4);
+    request.at_micros = len >= binary_message_size + 8
+                            ? int64_t(load_be(buf + binary_message_size, 8))
+                            : 0;
+
+    if (uint8_t(buf[3]) != binary_protocol_version) {
+      reply_len = binary_reply(reply, request.token, binary_bad_request,
+                               binary_protocol_version);
+      return false;
+    }
+
+    auto &last_token = tokens[remote_key(addr)];
+    if (last_token >= request.token && request.command != binary_reset) {
+      reply_len =
+          binary_reply(reply, request.token, binary_already, last_token);
+      return false;
+    }
+    last_token = request.token;
+    return true;
+  }
+
+  size_t execute_binary_udp_request(binary_request const &request,
+                                    char *reply) {
+    auto respond = [&](binary_status status, uint64_t value) {
+      return binary_reply(reply, request.token, status, value);
+    };
+
+    if (binary_ping <= request.command && binary_stop >= request.command) {
+      count_request(request.command - binary_ping, request_transport);
+    }
+    switch (request.command) {
+    case binary_ping:
+    case binary_reset:
+      return respond(binary_pong, request.sequence);
+    case binary_stop:
+      stop(request.sequence);
+      return respond(binary_stopped, request.sequence);
+    case binary_play:
+    case binary_queue: {
+      uint64_t start_frame = 0;
+      if (request.at_micros) {
+        int64_t late_micros = 0;
+        if (!mixer) {
+          return respond(binary_failed, 0);
+        }
+        if (!mixer->frame_for_time(request.at_micros, start_frame,
+                                   late_micros)) {
+          return respond(binary_late, late_micros);
+        }
+      }
+      auto chunk = index_to_chunk(request.index);
+      if (!chunk) {
+        return respond(loader ? binary_loading : binary_no_sample, 0);
+      }
+      sequence_t seq = 0;
+      binary_status status = binary_failed;
+      if (request.command == binary_play) {
+        if ((seq = play(chunk, start_frame))) {
+          status = binary_playing;
+        }
       } else {
-        out << "FAILED" << std::endl;
-        return false;
+        switch (queue(request.sequence, chunk, seq, start_frame)) {
+        case queue_outcome::queued:
+          status = binary_queued;
+          break;
+        case queue_outcome::wait:
+          status = binary_wait;
+          break;
+        case queue_outcome::playing:
+          status = binary_playing;
+          break;
+        case queue_outcome::failed:
+          break;
+        }
       }
+      enforce_sample_budget();
+      return respond(status, seq);
+    }
+    default:
+      return respond(binary_bad_request, request.command);
     }
   }
 
-  void handle_udp_request(evutil_socket_t sock, const std::string &buf,
-                          const void *addr, int addr_len) {
+  // parses the request in place and writes the reply into reply, which
+  // must hold binary_message_size bytes; returns the reply length, 0 for
+  // no reply. Nothing here allocates.
+  size_t handle_binary_udp_request(char const *buf, size_t len,
+                                   const void *addr, int addr_len,
+                                   char *reply, int64_t received_nanos) {
+    binary_request request;
+    size_t reply_len;
+    if (!parse_binary_udp_request(buf, len, addr, binary_client_tokens,
+                                  request, reply, reply_len)) {
+      return reply_len;
+    }
+    timed_request _{*this, received_nanos, transport_udp_binary};
+    return execute_binary_udp_request(request, reply);
+  }
+
+  static std::string udp_reply_header(uint64_t token) {
+    std::ostringstream out;
+    out << "audiomixserver/3" << std::endl << "TOKEN " << token << std::endl;
+    return out.str();
+  }
+
+  // parses a text request and checks its client token against tokens.
+  // Returns the command to execute, or nullptr with any reply to send
+  // straight away in reply. Touches nothing but tokens, so it can run on
+  // any thread.
+  static evhttp_uri *
+  parse_text_udp_request(const std::string &buf, const void *addr,
+                         int addr_len,
+                         std::unordered_map<std::string, uint64_t> &tokens,
+                         uint64_t &client_token_number, std::string &reply) {
     std::istringstream in(buf);
 
     std::string client;
@@ -933,40 +5907,222 @@ struct context {
     std::getline(in, cmd);
     std::getline(in, path);
 
-    std::ostringstream out;
-
-    auto client_token_number = std::stoull(client_token);
+    try {
+      client_token_number = std::stoull(client_token);
+    } catch (std::exception &e) {
+      log_warning("Bad client token {}: {}", client_token, e.what());
+      return nullptr;
+    }
 
     auto remote = remote_address(addr, addr_len);
-    std::cout << "Received UDP request from " << remote << " for " << client
-              << " with token " << client_token_number << ": " << cmd << " "
-              << path << std::endl;
+    log_info("Received UDP request from {} for {} with token {}: {} {}", remote,
+             client, client_token_number, cmd, path);
 
     if (!starts_with("audiomixclient/", client)) {
-      std::cerr << "Not an audiomixclient: " << client << std::endl;
+      log_warning("Not an audiomixclient: {}", client);
+      return nullptr;
+    }
+
+    auto &last_token = tokens[remote];
+    if (last_token >= client_token_number && cmd != "reset") {
+      reply = udp_reply_header(client_token_number) + "ALREADY " +
+              std::to_string(last_token) + "\n";
+      return nullptr;
+    }
+    last_token = client_token_number;
+
+    auto uri = evhttp_uri_parse(cmd.c_str());
+    if (!uri) {
+      reply = udp_reply_header(client_token_number) + "BAD REQUEST\n";
+    }
+    return uri;
+  }
+
+  std::string execute_text_udp_request(uint64_t token, evhttp_uri const *uri,
+                                       int64_t received_nanos) {
+    std::ostringstream out;
+    out << udp_reply_header(token);
+    {
+      timed_request _{*this, received_nanos, transport_udp_text};
+      handle_request(out, uri);
+    }
+    enforce_sample_budget();
+    return out.str();
+  }
+
+  std::string handle_udp_request(const std::string &buf, const void *addr,
+                                 int addr_len, int64_t received_nanos) {
+    uint64_t token;
+    std::string reply;
+    auto uri = std::unique_ptr<evhttp_uri, decltype(&evhttp_uri_free)>(
+        parse_text_udp_request(buf, addr, addr_len, client_tokens, token,
+                               reply),
+        &evhttp_uri_free);
+    if (!uri) {
+      return reply;
+    }
+    return execute_text_udp_request(token, uri.get(), received_nanos);
+  }
+
+  // runs on a --udp_threads thread: everything up to executing the
+  // request happens here, the rest is queued for the libevent thread
+  void handle_udp_worker_events(udp_worker &worker) {
+#ifdef __linux__
+    if (worker.worker_batch) {
+      handle_udp_worker_batches(worker);
       return;
     }
+#endif
+    struct sockaddr_storage addr;
+    char buf[1 << 16];
+    for (;;) {
+      socklen_t addr_len = sizeof(addr);
+      auto bytes = recvfrom(worker.worker_sock, buf, sizeof(buf), 0,
+                            (struct sockaddr *)&addr, &addr_len);
+      if (bytes < 0) {
+        return;
+      }
+      count_udp_batch(1);
+
+      udp_work work{};
+      std::string reply;
+      char binary_reply[binary_message_size];
+      size_t binary_reply_len;
+      if (parse_udp_work(worker, buf, bytes, addr, addr_len, now_nanos(),
+                         work, reply, binary_reply, binary_reply_len)) {
+        post_udp_work(work);
+      } else if (binary_reply_len) {
+        send_udp_reply(worker.worker_sock, binary_reply, binary_reply_len,
+                       &addr, addr_len);
+      } else {
+        send_udp_reply(worker.worker_sock, reply.data(), reply.size(), &addr,
+                       addr_len);
+      }
+    }
+  }
 
-    out << "audiomixserver/3" << std::endl
-        << "TOKEN " << client_token_number << std::endl;
+#ifdef __linux__
+  // handle_udp_worker_events with recvmmsg; the replies to requests
+  // refused here go back together with sendmmsg
+  void handle_udp_worker_batches(udp_worker &worker) {
+    auto &b = *worker.worker_batch;
+    for (;;) {
+      b.prepare_receive();
+      auto received = recvmmsg(worker.worker_sock, b.messages.data(),
+                               b.batch_size, MSG_DONTWAIT, nullptr);
+      if (received <= 0) {
+        return;
+      }
+      count_udp_batch(received);
+
+      unsigned replies = 0;
+      for (unsigned i = 0; unsigned(received) > i; ++i) {
+        udp_work work{};
+        auto &reply = b.text_replies[i];
+        auto binary_reply = b.binary_replies[i].data();
+        size_t binary_reply_len;
+        if (parse_udp_work(worker, b.buffer(i), b.messages[i].msg_len,
+                           b.addrs[i], b.messages[i].msg_hdr.msg_namelen,
+                           b.received_nanos(i), work, reply, binary_reply,
+                           binary_reply_len)) {
+          post_udp_work(work);
+        } else if (binary_reply_len) {
+          b.add_reply(replies++, i, binary_reply, binary_reply_len);
+        } else if (!reply.empty()) {
+          b.add_reply(replies++, i, reply.data(), reply.size());
+        }
+      }
+      send_udp_replies(worker.worker_sock, b, replies);
 
-    if (client_tokens[remote] >= client_token_number && cmd != "reset") {
-      out << "ALREADY " << client_tokens[remote] << std::endl;
-    } else {
-      client_tokens[remote] = client_token_number;
-      auto uri = std::unique_ptr<evhttp_uri, decltype(&evhttp_uri_free)>(
-          evhttp_uri_parse(cmd.c_str()), &evhttp_uri_free);
-      handle_request(out, uri.get());
+      if (unsigned(received) < b.batch_size) {
+        return;
+      }
+    }
+  }
+#endif
+
+  // reads a datagram into work for the libevent thread; false if it is
+  // refused here instead, with any reply to it in binary_reply, when
+  // binary_reply_len is not 0, or else in reply
+  bool parse_udp_work(udp_worker &worker, char const *buf, size_t len,
+                      sockaddr_storage const &addr, socklen_t addr_len,
+                      int64_t received_nanos, udp_work &work,
+                      std::string &reply, char *binary_reply,
+                      size_t &binary_reply_len) {
+    binary_reply_len = 0;
+    reply.clear();
+    work.work_received_nanos = received_nanos;
+    work.work_sock = worker.worker_sock;
+    std::memcpy(&work.work_addr, &addr, addr_len);
+    work.work_addr_len = addr_len;
+    if (is_binary_udp_request(buf, len)) {
+      if (!parse_binary_udp_request(buf, len, &addr,
+                                    worker.binary_client_tokens,
+                                    work.work_binary, binary_reply,
+                                    binary_reply_len)) {
+        return false;
+      }
+      work.work_token = work.work_binary.token;
+      return true;
     }
+    work.work_uri = parse_text_udp_request(std::string(buf, len), &addr,
+                                           addr_len, worker.client_tokens,
+                                           work.work_token, reply);
+    return work.work_uri;
+  }
 
-    auto msg = out.str();
+  void post_udp_work(udp_work &work) {
+    if (!udp_queue->push(work)) {
+      log_warning("UDP work queue full, dropping request with token {}",
+                  work.work_token);
+      if (work.work_uri) {
+        evhttp_uri_free(work.work_uri);
+        auto reply = udp_reply_header(work.work_token) + "BUSY\n";
+        send_udp_reply(work.work_sock, reply.data(), reply.size(),
+                       &work.work_addr, work.work_addr_len);
+      } else {
+        char reply[binary_message_size];
+        auto reply_len =
+            binary_reply(reply, work.work_token, binary_busy, 0);
+        send_udp_reply(work.work_sock, reply, reply_len, &work.work_addr,
+                       work.work_addr_len);
+      }
+      return;
+    }
+    // only wake the libevent thread if it is not already on its way
+    if (!udp_wake_pending.exchange(true)) {
+      char wake = 0;
+      if (write(udp_wake_pipe[1], &wake, 1) < 0) {
+        log_error("post_udp_work write {}", std::strerror(errno));
+      }
+    }
+  }
 
-    if (sendto(sock, msg.data(), msg.size(), 0,
-               static_cast<const sockaddr *>(addr),
-               addr_len) != ssize_t(msg.size())) {
-      std::cerr << "sendto "
-                << evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR())
-                << std::endl;
+  void drain_udp_work() {
+    char drain[64];
+    while (read(udp_wake_pipe[0], drain, sizeof(drain)) > 0) {
+    }
+    udp_wake_pending = false;
+
+    udp_work work;
+    while (udp_queue->pop(work)) {
+      if (work.work_uri) {
+        auto reply = execute_text_udp_request(work.work_token, work.work_uri,
+                                              work.work_received_nanos);
+        evhttp_uri_free(work.work_uri);
+        send_udp_reply(work.work_sock, reply.data(), reply.size(),
+                       &work.work_addr, work.work_addr_len);
+      } else {
+        char reply[binary_message_size];
+        size_t reply_len;
+        {
+          timed_request _{*this, work.work_received_nanos,
+                          transport_udp_binary};
+          reply_len = execute_binary_udp_request(work.work_binary, reply);
+        }
+        send_udp_reply(work.work_sock, reply, reply_len, &work.work_addr,
+                       work.work_addr_len);
+      }
     }
   }
 
@@ -975,9 +6131,8 @@ struct context {
     evhttp *ev_web = evhttp_start(vm["bind_address"].as<std::string>().c_str(),
                                   vm["bind_port"].as<int>());
     if (!ev_web) {
-      std::cerr << "evhttp_start "
-                << evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR())
-                << std::endl;
+      log_error("evhttp_start {}",
+                evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR()));
       return false;
     }
     evhttp_set_gencb(ev_web,
@@ -989,39 +6144,52 @@ struct context {
   }
 
   void make_fire_server_request(std::string const &path) {
-    std::cout << "make_fire_server_request " << path << std::endl;
-    auto req = evhttp_request_new(fire_server_http_request_done, nullptr);
-    evhttp_make_request(fire_server_connection, req, EVHTTP_REQ_GET, path.c_str());
+    if (!fire.connections.empty()) {
+      fire.request(path);
+    }
   }
 
   bool init_fire_server() {
-    fire_server_connection = evhttp_connection_new(
-                                                   vm["fire_server_address"].as<std::string>().c_str(),
-                                                   vm["fire_server_port"].as<int>());
-    evhttp_connection_set_timeout(fire_server_connection, 1);
+    if (!fire.init(vm["fire_server_address"].as<std::string>(),
+                   vm["fire_server_port"].as<int>(),
+                   vm["fire_server_connections"].as<int>(),
+                   vm["fire_server_timeout_ms"].as<int>(),
+                   vm["fire_server_queue"].as<size_t>(),
+                   vm["fire_server_retries"].as<int>(),
+                   vm["fire_server_coalesce_ms"].as<int>())) {
+      return false;
+    }
     make_fire_server_request("/");
-    
-    return fire_server_connection;
+    return true;
   }
 
-  bool init_udp() {
-    // no cleanup, no need
+  evutil_socket_t make_udp_socket(bool reuse_port) {
     auto sock = socket(AF_INET, SOCK_DGRAM, 0);
     if (sock < 0) {
-      std::cerr << "socket: " << EVUTIL_SOCKET_ERROR() << std::endl;
-      return false;
+      log_error("socket: {}", EVUTIL_SOCKET_ERROR());
+      return -1;
     }
     if (evutil_make_socket_nonblocking(sock)) {
-      std::cerr << "evutil_make_socket_nonblocking "
-                << evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR())
-                << std::endl;
-      return false;
+      log_error("evutil_make_socket_nonblocking {}",
+                evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR()));
+      return -1;
     }
     if (evutil_make_listen_socket_reuseable(sock)) {
-      std::cerr << "evutil_make_socket_reuseable "
-                << evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR())
-                << std::endl;
-      return false;
+      log_error("evutil_make_socket_reuseable {}",
+                evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR()));
+      return -1;
+    }
+#ifdef __linux__
+    // for recvmmsg to read when each datagram arrived
+    int on = 1;
+    if (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on))) {
+      log_error("setsockopt SO_TIMESTAMPNS {}", std::strerror(errno));
+    }
+#endif
+    if (reuse_port && evutil_make_listen_socket_reuseable_port(sock)) {
+      log_error("evutil_make_listen_socket_reuseable_port {}",
+                evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR()));
+      return -1;
     }
 
     struct sockaddr_in addr;
@@ -1030,12 +6198,32 @@ struct context {
     addr.sin_addr.s_addr = INADDR_ANY;
 
     if (bind(sock, (struct sockaddr *)&addr, sizeof(addr))) {
-      std::cerr << "bind "
-                << evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR())
-                << std::endl;
+      log_error("bind {}",
+                evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR()));
+      return -1;
+    }
+    return sock;
+  }
+
+  bool init_udp() {
+    // no cleanup, no need
+    auto threads = vm["udp_threads"].as<int>();
+    if (threads > 0) {
+      return init_udp_workers(threads);
+    }
+
+    auto sock = make_udp_socket(false);
+    if (sock < 0) {
       return false;
     }
 
+#ifdef __linux__
+    auto batch_size = vm["udp_batch_size"].as<int>();
+    if (batch_size > 1) {
+      batch = std::make_unique<udp_batch>(batch_size);
+    }
+#endif
+
     event_set(&udp_event, sock, EV_READ | EV_PERSIST,
               [](evutil_socket_t sock, short what, void *ctx) -> void {
                 static_cast<context *>(ctx)->handle_udp_events(sock);
@@ -1046,83 +6234,642 @@ struct context {
     return true;
   }
 
-  void sequence_done(sequence_t sequence) {
-    if (!sequence) {
+  // one SO_REUSEPORT socket, event base and thread per worker; the
+  // kernel hashes each remote address to one socket, which shards the
+  // client tokens with no lock between the workers
+  bool init_udp_workers(int threads) {
+    udp_queue = std::make_unique<mpsc_ring<udp_work>>(4096);
+    if (pipe(udp_wake_pipe) || evutil_make_socket_nonblocking(udp_wake_pipe[0])) {
+      log_error("pipe {}", std::strerror(errno));
+      return false;
+    }
+    event_set(&udp_wake_event, udp_wake_pipe[0], EV_READ | EV_PERSIST,
+              [](evutil_socket_t, short, void *ctx) -> void {
+                static_cast<context *>(ctx)->drain_udp_work();
+              },
+              this);
+    event_add(&udp_wake_event, nullptr);
+
+    for (int t = 0; threads > t; ++t) {
+      auto sock = make_udp_socket(true);
+      if (sock < 0) {
+        return false;
+      }
+      udp_workers.push_back(std::make_unique<udp_worker>());
+      auto &worker = *udp_workers.back();
+      worker.worker_ctx = this;
+      worker.worker_sock = sock;
+#ifdef __linux__
+      auto batch_size = vm["udp_batch_size"].as<int>();
+      if (batch_size > 1) {
+        worker.worker_batch = std::make_unique<udp_batch>(batch_size);
+      }
+#endif
+      if (pipe(worker.stop_pipe)) {
+        log_error("pipe {}", std::strerror(errno));
+        return false;
+      }
+      worker.worker_base = event_base_new();
+      worker.worker_event =
+          event_new(worker.worker_base, sock, EV_READ | EV_PERSIST,
+                    [](evutil_socket_t, short, void *ptr) -> void {
+                      auto worker = static_cast<udp_worker *>(ptr);
+                      worker->worker_ctx->handle_udp_worker_events(*worker);
+                    },
+                    &worker);
+      worker.stop_event =
+          event_new(worker.worker_base, worker.stop_pipe[0], EV_READ,
+                    [](evutil_socket_t, short, void *base) -> void {
+                      event_base_loopbreak(static_cast<event_base *>(base));
+                    },
+                    worker.worker_base);
+      event_add(worker.worker_event, nullptr);
+      event_add(worker.stop_event, nullptr);
+      worker.worker_thread = std::thread([&worker] {
+        logger.claim_ring();
+        if (event_base_dispatch(worker.worker_base) == -1) {
+          log_error("event_base_dispatch udp worker");
+          std::exit(7);
+        }
+      });
+    }
+    log_info("Receiving UDP on {} threads", threads);
+    return true;
+  }
+
+
+  bool init_voice_stealing() {
+    auto policy = vm["voice_stealing"].as<std::string>();
+    if ("none" == policy) {
+      stealer.policy = voice_stealer::no_stealing;
+    } else if ("oldest" == policy) {
+      stealer.policy = voice_stealer::steal_oldest;
+    } else if ("quietest" == policy) {
+      stealer.policy = voice_stealer::steal_quietest;
+    } else if ("priority" == policy) {
+      stealer.policy = voice_stealer::steal_by_priority;
+    } else {
+      log_error("Unknown voice_stealing policy {}", policy);
+      return false;
+    }
+
+    if (vm.count("sample_priority")) {
+      for (auto const &setting :
+           vm["sample_priority"].as<std::vector<std::string>>()) {
+        auto equals = setting.rfind('=');
+        try {
+          if (equals == std::string::npos) {
+            throw std::invalid_argument("no =");
+          }
+          sample_priorities[setting.substr(0, equals)] =
+              std::stoi(setting.substr(equals + 1));
+        } catch (std::exception &e) {
+          log_error("Bad sample_priority {}, expected sample=priority",
+                    setting);
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  // without realtime the mixer is left for the caller to run, as
+  // render_script does
+  bool init_mixer_engine(bool realtime = true) {
+    int frequency;
+    Uint16 format;
+    int channels;
+    if (!Mix_QuerySpec(&frequency, &format, &channels)) {
+      log_error("Mix_QuerySpec {}", Mix_GetError());
+      return false;
+    }
+    if (format != AUDIO_S16SYS) {
+      log_error("lockfree_mixer needs AUDIO_S16SYS, got {}", format);
+      return false;
+    }
+
+    auto chunksize = vm["chunksize"].as<int>();
+    auto taps = vm["resampler_taps"].as<int>();
+    if (taps < 2 || taps > 256 || taps % 2) {
+      log_error("resampler_taps must be even, from 2 to 256, not {}", taps);
+      return false;
+    }
+    mixer = std::make_unique<mixer_engine>(voice_count(vm), frequency,
+                                           channels, chunksize);
+    mixer->resampler_taps = taps;
+    mixer->virtual_clock = !realtime;
+    mixer->latency = &latency;
+    if (!realtime) {
+      return true;
+    }
+
+    Mix_SetPostMix(
+        [](void *engine, Uint8 *stream, int len) {
+          log_from_audio_thread = true;
+          static_cast<mixer_engine *>(engine)->mix(stream, len);
+        },
+        mixer.get());
+    return true;
+  }
+
+  // The audio callback, through the mixer or SDL_mixer's channel finished
+  // callback, posts completions, and completions_posted's thread signals
+  // the libevent thread, which handles them, within a buffer's time
+  bool init_completions() {
+    if (!mixer) {
+      sdl_channels = std::make_unique<sdl_channel_table>(
+          voice_count(vm), vm["sequence_slots"].as<size_t>());
+    }
+    auto period = std::chrono::microseconds(
+        1000000L * vm["chunksize"].as<int>() / vm["frequency"].as<int>());
+    auto posted = [mixer = mixer.get(), sdl_channels = sdl_channels.get()] {
+      return mixer ? !mixer->completions.empty()
+                   : !sdl_channels->finished.empty() ||
+                         sdl_channels->lost.load(std::memory_order_relaxed);
+    };
+    if (!completions_posted.open(period, posted)) {
+      return false;
+    }
+    event_set(&completion_event, completions_posted.fds[0],
+              EV_READ | EV_PERSIST,
+              [](evutil_socket_t, short, void *ctx) -> void {
+                static_cast<context *>(ctx)->drain_completions();
+              },
+              this);
+    event_add(&completion_event, nullptr);
+    return true;
+  }
+
+  void drain_completions() {
+    completions_posted.clear();
+    if (mixer) {
+      drain_mixer_completions();
+      return;
+    }
+    sdl_channel_table::channel_completion completion;
+    while (sdl_channels->finished.pop(completion)) {
+      finished_channel(completion.channel, completion.sequence, 0,
+                       completion.chained);
+    }
+    if (auto lost = sdl_channels->lost.exchange(0)) {
+      log_error("{} channel completions had no room; recovering them", lost);
+      recover_finished_channels();
+    }
+    free_retired_chunks();
+    completions_posted.set_busy(sequences.any_channel());
+  }
+
+  // finishes whatever the table has on a channel that SDL_mixer no longer
+  // plays it on, for completions the callback could not post
+  void recover_finished_channels() {
+    for (int channel = 0; sdl_channels->channel_count > channel; ++channel) {
+      auto sequence = sequences.channel(channel);
+      auto playing = sdl_channels->channels[channel].playing.load();
+      if (!sequence || playing == sequence) {
+        continue;
+      }
+      auto status = sequences.find(sequence);
+      finished_channel(channel, sequence, 0,
+                       status && status->next_sequence == playing ? playing
+                                                                  : 0);
+    }
+  }
+
+  void drain_mixer_completions() {
+    mixer->drain_completions([&](mixer_completion const &completion) {
+      auto status = completion.late ? sequences.find(completion.sequence)
+                                    : nullptr;
+      if (status) {
+        // its request was answered long ago, so the miss shows in
+        // /stats and /metrics
+        auto frames = completion.end_frame - status->sequence_start_frame;
+        latency.missed_start.record(frames * 1000000000 / mixer->frequency);
+        log_warning("{} sequence {} reached the mixer {} frames after its "
+                    "start time",
+                    time_millis(), completion.sequence, frames);
+      }
+      finished_channel(completion.voice, completion.sequence,
+                       completion.end_frame);
+    });
+    free_retired_chunks();
+    completions_posted.set_busy(sequences.any_channel());
+  }
+
+  // end_frame is where it stopped in the lockfree mixer, 0 for now
+  void sequence_done(sequence_t sequence, uint64_t end_frame = 0) {
+    if (!sequence) {
+      return;
+    }
+    gl_rainbow.fire_start = 0;
+
+    if (auto done = sequences.find(sequence)) {
+      auto status = *done;
+      sequences.erase(sequence);
+      unpin_chunk(status.sequence_chunk);
+      if (status.next_sequence) {
+        auto next_status = sequences.find(status.next_sequence);
+        if (next_status && next_status->sequence_channel < 0 && !mixer) {
+          unchain_sdl_channel(status.next_sequence, *next_status);
+        }
+        if (next_status && next_status->sequence_channel >= 0) {
+          // chained in the mixer or SDL_mixer's callback, so already
+          // playing
+          log_info("{} chained play of {} after {}", time_millis(),
+                   status.next_sequence, sequence);
+          set_brightness(next_status->sequence_brightness, end_frame,
+                         status.next_sequence);
+          chain_ahead(status.next_sequence);
+        } else if (next_status) {
+          log_info("{} queued play of {} after {}", time_millis(),
+                   status.next_sequence, sequence);
+          start_sequence(status.next_sequence);
+        }
+      }
+    }
+  }
+
+  // chained is what SDL_mixer's callback started on the channel as
+  // sequence ended, if anything
+  void finished_channel(int channel, sequence_t sequence,
+                        uint64_t end_frame = 0, sequence_t chained = 0) {
+    log_info("{} finished playing {} on channel {}", time_millis(), sequence,
+             channel);
+    if (sequence && morse_sequence == sequence) {
+      laser.cancel_after(output_micros(end_frame), sequence);
+    }
+    // a completion drained after its channel was reused leaves the
+    // channel to the sequence now on it
+    if (sequences.channel(channel) == sequence) {
+      set_brightness(0., end_frame, sequence);
+      sequences.channel(channel) = 0;
+      stealer.release(channel);
+    }
+    if (auto next = sequences.find(chained)) {
+      sequences.channel(channel) = chained;
+      next->sequence_channel = channel;
+      next->sequence_chained_channel = -1;
+      start_stealable(channel, next->sequence_chunk,
+                      next->sequence_options.gain);
+    } else if (chained) {
+      // no longer known, so nothing else would ever stop it
+      sdl_channels->halt(channel, chained);
+    }
+    sequence_done(sequence, end_frame);
+  }
+
+  void setup_opengl_thread() {
+    log_info("setup_opengl_thread GL {}", glGetString(GL_VERSION));
+    clear_gl_errors();
+    gl_rainbow.init_rainbow();
+    gl_lozenge.init_lozenge();
+    gl_sprites.init_sprites();
+  }
+
+  void render_frame_with_opengl() {
+    clear_gl_errors();
+    glEnable(GL_BLEND);
+    //    glEnable(GL_DEPTH_TEST);  
+    glBlendFunc(GL_SRC_ALPHA,GL_ONE_MINUS_SRC_ALPHA);
+    glClearColor(background_r, background_g, background_b, 1.0);
+    glClear(GL_COLOR_BUFFER_BIT|GL_DEPTH_BUFFER_BIT);
+
+    gl_sprites.render_sprites();
+    gl_rainbow.render_rainbow(background_r, background_g, background_b);
+    gl_lozenge.render_lozenges();
+
+    glFinish();
+    clear_gl_errors();
+  }
+
+  void maybe_load_file_from_name(std::string const& file) {
+    if (chunks.find(file) != chunks.end()) {
+      return;
+    }
+    if (budget) {
+      index_sample_file(file);
+      return;
+    }
+    auto chunk = load_sample_file(file);
+    if (!chunk) {
+      return;
+    }
+
+    chunks[file] = chunk;
+    ordered_chunks.push_back(chunk);
+    ordered_names.push_back(file);
+    weigh_chunk(file, chunk);
+  }
+
+  // registers a sample to be decoded on first play
+  void index_sample_file(std::string const &file) {
+    struct stat st;
+    if (stat(file.c_str(), &st)) {
+      log_error("Could not index {}: {}", file, std::strerror(errno));
+      return;
+    }
+    chunks[file] = nullptr;
+    ordered_chunks.push_back(nullptr);
+    ordered_names.push_back(file);
+  }
+
+  bool init_sample_cache() {
+    auto option = vm["sample_cache_dir"];
+    if (option.empty()) {
+      return true;
+    }
+    cache = std::make_unique<sample_cache>();
+    cache->cache_directory = option.as<std::string>();
+    cache->any_rate = native_rate_samples();
+    if (!Mix_QuerySpec(&cache->frequency, &cache->format, &cache->channels)) {
+      log_error("Mix_QuerySpec {}", Mix_GetError());
+      cache.reset();
+      return false;
+    }
+    if (mkdir(cache->cache_directory.c_str(), 0755) && errno != EEXIST) {
+      log_error("mkdir {}: {}", cache->cache_directory, std::strerror(errno));
+      cache.reset();
+      return false;
+    }
+    return true;
+  }
+
+  Mix_Chunk *load_sample_file(std::string const &file) {
+    int rate;
+    // with a cache the file is read once, and on a miss decoded from
+    // what was read
+    std::vector<char> source;
+    bool in_memory = cache && sample_cache::read_source(file, source);
+    if (in_memory) {
+      if (auto chunk = cache->load(file, source, rate)) {
+        log_info("Mapped {} from sample cache", file);
+        remember_rate(chunk, rate);
+        return chunk;
+      }
+    }
+    auto open_source = [&] {
+      return in_memory ? SDL_RWFromConstMem(source.data(), source.size())
+                       : SDL_RWFromFile(file.c_str(), "rb");
+    };
+
+    log_info("Loading {}", file);
+    auto chunk =
+        native_rate_samples() ? load_native_wav(open_source(), rate) : nullptr;
+    if (!chunk) {
+      chunk = Mix_LoadWAV_RW(open_source(), 1);
+      Uint16 format;
+      int channels;
+      Mix_QuerySpec(&rate, &format, &channels);
+    }
+    if (!chunk) {
+      log_error("Could not load {}: {}", file, Mix_GetError());
+      return nullptr;
+    }
+
+    // swap the freshly decoded copy for the mapping so that even the
+    // first run shares its pages
+    if (in_memory && cache->store(file, source, chunk, rate)) {
+      if (auto mapped = cache->load(file, source, rate)) {
+        Mix_FreeChunk(chunk);
+        chunk = mapped;
+      }
+    }
+    remember_rate(chunk, rate);
+    return chunk;
+  }
+
+  bool native_rate_samples() const {
+    return vm["native_rate_samples"].as<bool>() &&
+           vm["lockfree_mixer"].as<bool>();
+  }
+
+  // decodes a WAV, closing src, to the output format and channels but
+  // leaves it at its own rate for the mixer to resample; nullptr for
+  // anything else, which Mix_LoadWAV_RW then converts as usual
+  Mix_Chunk *load_native_wav(SDL_RWops *src, int &rate) {
+    int frequency, channels;
+    Uint16 format;
+    if (!Mix_QuerySpec(&frequency, &format, &channels)) {
+      if (src) {
+        SDL_RWclose(src);
+      }
+      return nullptr;
+    }
+    SDL_AudioSpec spec;
+    Uint8 *wav;
+    Uint32 wav_len;
+    if (!SDL_LoadWAV_RW(src, 1, &spec, &wav, &wav_len)) {
+      return nullptr;
+    }
+    SDL_AudioCVT cvt;
+    if (SDL_BuildAudioCVT(&cvt, spec.format, spec.channels, spec.freq, format,
+                          channels, spec.freq) < 0) {
+      SDL_FreeWAV(wav);
+      return nullptr;
+    }
+    cvt.len = wav_len;
+    cvt.buf = static_cast<Uint8 *>(SDL_malloc(size_t(wav_len) * cvt.len_mult));
+    if (!cvt.buf) {
+      SDL_FreeWAV(wav);
+      return nullptr;
+    }
+    std::memcpy(cvt.buf, wav, wav_len);
+    SDL_FreeWAV(wav);
+    cvt.len_cvt = cvt.len;
+    if (cvt.needed && SDL_ConvertAudio(&cvt) < 0) {
+      SDL_free(cvt.buf);
+      return nullptr;
+    }
+    auto chunk = Mix_QuickLoad_RAW(cvt.buf, cvt.len_cvt);
+    if (!chunk) {
+      SDL_free(cvt.buf);
+      return nullptr;
+    }
+    chunk->allocated = 1; // so Mix_FreeChunk frees cvt.buf
+    rate = spec.freq;
+    return chunk;
+  }
+
+  // called from the loader threads as well
+  void remember_rate(Mix_Chunk *chunk, int rate) {
+    int frequency, channels;
+    Uint16 format;
+    if (!Mix_QuerySpec(&frequency, &format, &channels) || rate == frequency) {
       return;
     }
-    gl_rainbow.fire_start = 0;
+    std::lock_guard<std::mutex> _{chunk_rates_mutex};
+    chunk_rates[chunk] = rate;
+  }
 
-    auto i = sequence_to_status.find(sequence);
-    if (i != sequence_to_status.end()) {
-      auto status = i->second;
-      sequence_to_status.erase(i);
-      if (status.next_sequence) {
-        auto next_status = sequence_to_status.find(status.next_sequence);
-        if (next_status != sequence_to_status.end()) {
-          std::cout << time_millis() << " queued play of "
-                    << status.next_sequence << " after " << sequence
-                    << std::endl;
-          start_sequence(next_status);
-        }
+  // source frames per output frame for the mixer, in 32.32 fixed point
+  uint64_t voice_step(Mix_Chunk *chunk, float rate) {
+    double ratio = rate;
+    {
+      std::lock_guard<std::mutex> _{chunk_rates_mutex};
+      auto i = chunk_rates.find(chunk);
+      if (i != chunk_rates.end()) {
+        ratio *= double(i->second) / mixer->frequency;
       }
     }
+    return uint64_t(std::llround(ratio * mixer_engine::unity_step));
   }
 
-  void finished_channel(int channel) {
-    auto sequence = channel_to_sequence[channel];
-    std::cout << time_millis() << " finished playing " << sequence
-              << " on channel " << channel << std::endl;
-    set_brightness(0.);
+  void start_loading_samples(std::vector<std::string> const &filenames) {
+    std::vector<std::string> files;
+    for (auto &file : filenames) {
+      if (!chunks.count(file) && loading_files.insert(file).second) {
+        files.push_back(file);
+      }
+    }
 
-    channel_to_sequence.erase(channel);
-    sequence_done(sequence);
+    auto threads = vm["load_threads"].as<int>();
+    if (threads <= 0) {
+      // hardware_concurrency is 0 when it can't tell
+      threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    log_info("Loading {} samples on {} threads", files.size(), threads);
+    loader = std::make_unique<sample_loader>(
+        std::move(files), threads,
+        [this](std::string const &file) { return load_sample_file(file); });
   }
 
-  void setup_opengl_thread() {
-    std::cout << "setup_opengl_thread GL " << glGetString(GL_VERSION)
-              << std::endl;
-    clear_gl_errors();
-    gl_rainbow.init_rainbow();
-    gl_lozenge.init_lozenge();
-    gl_sprites.init_sprites();
+  bool merge_loaded_samples() {
+    if (!loader) {
+      return true;
+    }
+    auto done = loader->merge_finished(
+        [&](std::string const &file, Mix_Chunk *chunk) {
+          loading_files.erase(file);
+          if (!chunk) {
+            return;
+          }
+          if (chunks.count(file)) {
+            // already loaded on demand, e.g. by play_morse
+            free_chunk(chunk);
+            return;
+          }
+          chunks[file] = chunk;
+          ordered_chunks.push_back(chunk);
+          ordered_names.push_back(file);
+          weigh_chunk(file, chunk);
+        });
+    if (done) {
+      loader.reset();
+      log_info("{} loaded {} samples", time_millis(), ordered_chunks.size());
+    }
+    return done;
   }
 
-  void render_frame_with_opengl() {
-    clear_gl_errors();
-    glEnable(GL_BLEND);
-    //    glEnable(GL_DEPTH_TEST);  
-    glBlendFunc(GL_SRC_ALPHA,GL_ONE_MINUS_SRC_ALPHA);
-    glClearColor(background_r, background_g, background_b, 1.0);
-    glClear(GL_COLOR_BUFFER_BIT|GL_DEPTH_BUFFER_BIT);
+  bool init_sample_watcher(std::vector<std::string> const &filenames) {
+    std::vector<std::string> prefixes;
+    for (auto &file : filenames) {
+      auto slash = file.rfind('/');
+      auto prefix =
+          slash == std::string::npos ? std::string() : file.substr(0, slash + 1);
+      if (std::find(prefixes.begin(), prefixes.end(), prefix) ==
+          prefixes.end()) {
+        prefixes.push_back(prefix);
+      }
+    }
 
-    gl_sprites.render_sprites();
-    gl_rainbow.render_rainbow(background_r, background_g, background_b);
-    gl_lozenge.render_lozenges();
+    watcher = std::make_unique<sample_watcher>();
+    // under a sample_budget changed samples are decoded again on demand
+    std::function<Mix_Chunk *(std::string const &)> decode;
+    if (!budget) {
+      decode = [this](std::string const &file) {
+        return load_sample_file(file);
+      };
+    }
+    if (!watcher->start(prefixes, decode)) {
+      watcher.reset();
+      return false;
+    }
+    event_set(&watcher_event, watcher->wake_fd(), EV_READ | EV_PERSIST,
+              [](evutil_socket_t, short, void *ctx) -> void {
+                static_cast<context *>(ctx)->apply_reloaded_samples();
+              },
+              this);
+    event_add(&watcher_event, nullptr);
+    return true;
+  }
 
-    glFinish();
-    clear_gl_errors();
+  // runs on the libevent thread, the only one that reads chunks and
+  // ordered_chunks; the audio side only ever holds chunk pointers
+  // through sequences, and those keep replaced chunks alive
+  void apply_reloaded_samples() {
+    for (auto &reloaded : watcher->take_reloaded()) {
+      auto const &name = reloaded.first;
+      auto chunk = reloaded.second;
+      auto existing = chunks.find(name);
+      if (existing == chunks.end()) {
+        if (budget) {
+          index_sample_file(name);
+        } else if (chunk) {
+          chunks[name] = chunk;
+          ordered_chunks.push_back(chunk);
+          ordered_names.push_back(name);
+          weigh_chunk(name, chunk);
+        } else {
+          continue;
+        }
+        log_info("{} added sample {}", time_millis(), name);
+        continue;
+      }
+      if (!budget && !chunk) {
+        continue;
+      }
+
+      auto old = existing->second;
+      existing->second = chunk;
+      if (chunk) {
+        weigh_chunk(name, chunk);
+      }
+      if (!budget) {
+        std::replace(ordered_chunks.begin(), ordered_chunks.end(), old, chunk);
+      }
+      if (old) {
+        retire_chunk(old);
+      }
+      log_info("{} reloaded sample {}", time_millis(), name);
+    }
+    free_retired_chunks();
   }
 
-  void maybe_load_file_from_name(std::string const& file) {
-    if (chunks.find(file) != chunks.end()) {
+  void load_audio_from_filenames(std::vector<std::string> const& filenames) {  
+    auto budget_bytes = vm["sample_memory_budget"].as<size_t>();
+    if (budget_bytes) {
+      budget = std::make_unique<sample_budget>(budget_bytes);
+      for (auto &file : filenames) {
+        maybe_load_file_from_name(file);
+      }
+      log_info("Indexed {} samples to decode on demand", ordered_names.size());
       return;
     }
-    std::cout << "Loading " << file << std::endl;
-    auto chunk = Mix_LoadWAV(file.c_str());
-    if (!chunk) {
-      std::cerr << "Could not load " << file << ": " << Mix_GetError()
-                << std::endl;
-      return;
+
+    start_loading_samples(filenames);
+    for (auto &worker : loader->workers) {
+      worker.join();
     }
-    
-    chunks[file] = chunk;
-    ordered_chunks.push_back(chunk);
+    loader->workers.clear();
+    merge_loaded_samples();
   }
 
-  void load_audio_from_filenames(std::vector<std::string> const& filenames) {  
-    for (auto &file : filenames) {
-      maybe_load_file_from_name(file);
-    }
+  // serve requests straight away and merge samples as they are decoded,
+  // answering LOADING for the ones not ready yet
+  void load_audio_in_background(std::vector<std::string> const &filenames) {
+    start_loading_samples(filenames);
+
+    struct timeval period;
+    period.tv_sec = 0;
+    period.tv_usec = 50000;
+    event_set(&loader_event, -1, EV_PERSIST,
+              [](evutil_socket_t, short, void *ptr) -> void {
+                auto ctx = static_cast<context *>(ptr);
+                if (ctx->merge_loaded_samples()) {
+                  event_del(&ctx->loader_event);
+                }
+              },
+              this);
+    event_add(&loader_event, &period);
   }
   void load_3d_models_from_paths(std::vector<std::string> const& filenames) {  
     Assimp::Importer importer;
@@ -1175,7 +6922,707 @@ struct context {
 
 context *global_ctx;
 
-void finished_channel(int channel) { global_ctx->finished_channel(channel); }
+// SDL_mixer's channel finished callback, on the audio thread
+void post_finished_channel(int channel) {
+  log_from_audio_thread = true;
+  global_ctx->sdl_channels->channel_finished(channel);
+}
+
+// Runs mixer_engine::mix with every voice busy, once for each set of
+// kernels the CPU supports, to show how much of each audio callback is
+// left over at a given voice count. Each is run mixing directly and
+// resampling from 44.1kHz with resampler_taps.
+void benchmark_mixer(int frequency, int channels, int chunksize,
+                     int resampler_taps) {
+  std::mt19937 rnd;
+  std::uniform_int_distribution<int> dist(-8000, 8000);
+  std::vector<Sint16> noise(size_t(frequency) * channels * 10);
+  for (auto &sample : noise) {
+    sample = dist(rnd);
+  }
+  Mix_Chunk chunk{};
+  chunk.abuf = reinterpret_cast<Uint8 *>(noise.data());
+  chunk.alen = noise.size() * sizeof(Sint16);
+  chunk.volume = MIX_MAX_VOLUME / 2;
+
+  std::vector<Sint16> stream(size_t(chunksize) * channels);
+  double callback_micros = 1e6 * chunksize / frequency;
+
+  auto resampled_step = uint64_t(std::llround(
+      44100. / (frequency == 44100 ? 48000 : frequency) *
+      mixer_engine::unity_step));
+  for (auto const &kernels : available_mix_kernels()) {
+    for (auto step : {mixer_engine::unity_step, resampled_step}) {
+      for (int voice_count : {64, 512, 2048}) {
+        mixer_engine engine(voice_count, frequency, channels, chunksize);
+        engine.kernels = kernels;
+        engine.resampler_taps = resampler_taps;
+        for (int voice = 0; voice_count > voice; ++voice) {
+          engine.start_voice(&chunk, voice + 1, 0, step);
+        }
+        engine.apply_commands();
+        // spread the voices over the sample so they don't share cache lines
+        for (int voice = 0; voice_count > voice; ++voice) {
+          auto frame = voice * 4099 % (frequency * 9);
+          engine.voices[voice].voice_position = frame * channels;
+          engine.voices[voice].voice_phase = uint64_t(frame) << 32;
+        }
+
+        long callbacks = 0;
+        auto begin = std::chrono::steady_clock::now();
+        std::chrono::duration<double, std::micro> elapsed{0};
+        while (callbacks < 200 || elapsed.count() < 500000) {
+          std::fill(stream.begin(), stream.end(), 0);
+          engine.mix(reinterpret_cast<Uint8 *>(stream.data()),
+                     stream.size() * sizeof(Sint16));
+          engine.drain_completions([&](mixer_completion const &completion) {
+            engine.start_voice(&chunk, completion.sequence, 0, step);
+          });
+          ++callbacks;
+          elapsed = std::chrono::steady_clock::now() - begin;
+        }
+
+        auto micros_per_callback = elapsed.count() / callbacks;
+        std::cout << kernels.kernels_name << " " << voice_count << " voices"
+                  << (step == mixer_engine::unity_step ? "" : " resampled")
+                  << ": " << voice_count * 1000 / micros_per_callback
+                  << " voices/ms, " << micros_per_callback << "us of each "
+                  << callback_micros << "us callback ("
+                  << 100 * micros_per_callback / callback_micros << "%)"
+                  << std::endl;
+      }
+    }
+  }
+}
+
+// Times parsing a request and writing its reply over the text and the
+// binary UDP protocols, leaving out the socket calls, for reset and for
+// the commands that add sequences to the table, find them and erase
+// them: rounds of plays, queues after each and stops of both, with the
+// mixer run between rounds so voices come free. Returns the exit status.
+int benchmark_udp_parsing(context &ctx, int frequency, int channels,
+                          int chunksize) {
+  std::vector<Sint16> pcm(size_t(frequency) * channels, 1000);
+  Mix_Chunk chunk{};
+  chunk.abuf = reinterpret_cast<Uint8 *>(pcm.data());
+  chunk.alen = pcm.size() * sizeof(Sint16);
+  chunk.volume = MIX_MAX_VOLUME;
+  ctx.chunks["benchmark"] = &chunk;
+  ctx.ordered_chunks.push_back(&chunk);
+  ctx.ordered_names.push_back("benchmark");
+  ctx.mixer = std::make_unique<mixer_engine>(64, frequency, channels,
+                                             chunksize);
+  std::vector<Sint16> block(size_t(chunksize) * channels);
+
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(4242);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  size_t const group = 16;
+  long const rounds = 200000 / group;
+  uint64_t token = 0;
+  size_t reply_bytes = 0;
+  long failures = 0;
+  // a round's requests are built before they are timed
+  std::vector<std::string> text_requests(group);
+  std::vector<std::array<char, binary_message_size>> binary_requests(group);
+  std::string text_reply;
+  char binary_reply[binary_message_size];
+
+  for (auto binary : {false, true}) {
+    std::array<double, binary_stop + 1> nanos{};
+    std::array<long, binary_stop + 1> counts{};
+    // sends command for each of sequences, returning the sequence each
+    // reply names
+    auto send = [&](binary_command command,
+                    std::vector<sequence_t> const &sequences) {
+      for (size_t i = 0; sequences.size() > i; ++i) {
+        ++token;
+        if (binary) {
+          auto &request = binary_requests[i];
+          request.fill(0);
+          std::copy(std::begin(binary_protocol_magic),
+                    std::end(binary_protocol_magic), request.begin());
+          request[3] = binary_protocol_version;
+          request[4] = command;
+          store_be64(request.data() + 8, token);
+          store_be64(request.data() + 16, sequences[i]);
+        } else {
+          text_requests[i] = "audiomixclient/1\n" + std::to_string(token) +
+                             "\n/" + metric_commands[command - binary_ping] +
+                             "?sample=0&sequence=" +
+                             std::to_string(sequences[i]) + "\n\n";
+        }
+      }
+      std::vector<sequence_t> replied(sequences.size());
+      auto begin = std::chrono::steady_clock::now();
+      for (size_t i = 0; sequences.size() > i; ++i) {
+        if (binary) {
+          reply_bytes += ctx.handle_binary_udp_request(
+              binary_requests[i].data(), binary_message_size, &addr,
+              sizeof(addr), binary_reply, now_nanos());
+          auto status = binary_reply[4];
+          if (binary_playing == status || binary_queued == status) {
+            replied[i] = load_be(binary_reply + 16, 8);
+          }
+        } else {
+          text_reply = ctx.handle_udp_request(text_requests[i], &addr,
+                                              sizeof(addr), now_nanos());
+          reply_bytes += text_reply.size();
+          auto at = text_reply.find("PLAYING ");
+          if (at == std::string::npos) {
+            at = text_reply.find("QUEUED ");
+          }
+          if (at != std::string::npos) {
+            replied[i] = std::strtoull(
+                text_reply.c_str() + text_reply.find(' ', at) + 1, nullptr,
+                10);
+          }
+        }
+      }
+      std::chrono::duration<double, std::nano> elapsed =
+          std::chrono::steady_clock::now() - begin;
+      nanos[command] += elapsed.count();
+      counts[command] += sequences.size();
+      return replied;
+    };
+
+    std::vector<sequence_t> const none(group);
+    for (long round = 0; rounds > round; ++round) {
+      send(binary_reset, none);
+      auto played = send(binary_play, none);
+      auto queued = send(binary_queue, played);
+      send(binary_stop, queued);
+      send(binary_stop, played);
+      for (size_t i = 0; group > i; ++i) {
+        failures += !played[i] + !queued[i];
+      }
+      ctx.mixer->mix(reinterpret_cast<Uint8 *>(block.data()),
+                     block.size() * sizeof(Sint16));
+      ctx.drain_mixer_completions();
+    }
+    for (auto command : {binary_reset, binary_play, binary_queue,
+                         binary_stop}) {
+      std::cout << (binary ? "binary " : "text ")
+                << metric_commands[command - binary_ping] << ": "
+                << nanos[command] / counts[command] << " ns/request"
+                << std::endl;
+    }
+  }
+  auto leaked = ctx.sequences.slots.size() - ctx.sequences.free_slots.size();
+  std::cout << reply_bytes << " reply bytes, " << failures << " failures, "
+            << leaked << " sequences left" << std::endl;
+  return failures || leaked ? 1 : 0;
+}
+
+// Runs a fire_client against a stub fire server on a local port, which
+// fails the first two requests for /flaky, and checks that a burst of
+// requests past the queue drops the oldest, that repeats of a path are
+// coalesced, that /flaky is retried after 100 then 200ms, and that all
+// of it goes over the two kept-alive connections. Returns the exit
+// status.
+int check_fire_client() {
+  auto base = static_cast<event_base *>(event_init());
+  auto stub = evhttp_new(base);
+  auto bound = evhttp_bind_socket_with_handle(stub, "127.0.0.1", 0);
+  sockaddr_in bound_addr{};
+  socklen_t bound_len = sizeof(bound_addr);
+  if (!bound ||
+      getsockname(evhttp_bound_socket_get_fd(bound),
+                  reinterpret_cast<sockaddr *>(&bound_addr), &bound_len)) {
+    std::cerr << "check_fire_client could not listen" << std::endl;
+    return 1;
+  }
+  struct stub_server {
+    std::unordered_map<std::string, int> hits;
+    std::unordered_set<int> client_ports; // one a connection
+    std::vector<int64_t> flaky_nanos;
+  } server;
+  evhttp_set_gencb(
+      stub,
+      [](evhttp_request *req, void *arg) -> void {
+        auto server = static_cast<stub_server *>(arg);
+        std::string path = evhttp_request_get_uri(req);
+        char *address;
+        ev_uint16_t port;
+        evhttp_connection_get_peer(evhttp_request_get_connection(req),
+                                   &address, &port);
+        server->client_ports.insert(port);
+        auto hits = ++server->hits[path];
+        if ("/flaky" == path) {
+          server->flaky_nanos.push_back(now_nanos());
+        }
+        auto reply = evbuffer_new();
+        evbuffer_add_printf(reply, "%s %d", path.c_str(), hits);
+        if ("/flaky" == path && 2 >= hits) {
+          evhttp_send_reply(req, 503, "Busy", reply);
+        } else {
+          evhttp_send_reply(req, 200, "OK", reply);
+        }
+        evbuffer_free(reply);
+      },
+      &server);
+
+  fire_client client;
+  if (!client.init("127.0.0.1", ntohs(bound_addr.sin_port), 2, 1000, 16, 3,
+                   500)) {
+    return 1;
+  }
+  auto settle = [&] {
+    while (!client.idle()) {
+      event_base_loop(base, EVLOOP_ONCE);
+    }
+  };
+  int failures = 0;
+  auto expect = [&](char const *what, uint64_t got, uint64_t want) {
+    if (got != want) {
+      std::cout << what << " " << got << ", expected " << want << std::endl;
+      ++failures;
+    }
+  };
+
+  // two go out straight away and 16 wait, so the oldest 12 waiting drop
+  for (int i = 0; 30 > i; ++i) {
+    client.request("/burst" + std::to_string(i));
+  }
+  settle();
+  expect("burst sent", client.sent, 18);
+  expect("burst dropped", client.dropped, 12);
+  expect("last of burst served", server.hits["/burst29"], 1);
+
+  for (int i = 0; 20 > i; ++i) {
+    client.request("fire");
+  }
+  settle();
+  client.request("fire");
+  settle();
+  expect("fire sent", server.hits["/fire"], 1);
+  expect("fire coalesced", client.coalesced, 20);
+
+  client.request("/flaky");
+  settle();
+  expect("flaky attempts", server.hits["/flaky"], 3);
+  expect("retried", client.retried, 2);
+  expect("failed", client.failed, 0);
+  expect("succeeded", client.succeeded, client.sent - 2);
+  auto &flaky = server.flaky_nanos;
+  auto gap_millis = [&](size_t i) {
+    return flaky.size() > i ? (flaky[i] - flaky[i - 1]) / 1000000 : 0;
+  };
+  if (100 > gap_millis(1) || 200 > gap_millis(2)) {
+    std::cout << "flaky retried after " << gap_millis(1) << " and "
+              << gap_millis(2) << "ms, expected 100 and 200" << std::endl;
+    ++failures;
+  }
+  if (2 < server.client_ports.size()) {
+    std::cout << server.client_ports.size()
+              << " connections, expected at most 2" << std::endl;
+    ++failures;
+  }
+
+  std::cout << client.sent << " fire server requests: " << client.succeeded
+            << " ok, " << client.retried << " retried, " << client.coalesced
+            << " coalesced, " << client.dropped << " dropped over "
+            << server.client_ports.size() << " connections, /flaky retried "
+            << "after " << gap_millis(1) << " and " << gap_millis(2) << "ms"
+            << std::endl;
+  return failures ? 1 : 0;
+}
+
+// Drives the laser through gpio_path with the edges of SOS at 20ms a dot,
+// each with an edge it replaces due at the same time and a repeat of its
+// level halfway through, and checks the line reads back at each level a
+// quarter of a dot in, is written once per change and no write is more
+// than max_late_micros late. Returns the exit status.
+int check_laser_edges(std::string const &path, int line, int off_value,
+                      int64_t max_late_micros) {
+  laser_driver laser;
+  if (!laser.open_line(path, line, off_value)) {
+    return 1;
+  }
+  int64_t const unit_micros = 20000;
+  std::vector<std::pair<int64_t, int>> levels; // units from the start
+  int64_t units = 0;
+  for (auto c : std::string("SOS")) {
+    for (auto element : character_to_morse.at(c)) {
+      levels.emplace_back(units, 1);
+      units += '-' == element ? 3 : 1;
+      levels.emplace_back(units, 0);
+      ++units;
+    }
+    units += 2;
+  }
+
+  auto begin = now_nanos() / 1000 + 50000;
+  auto at = [&](int64_t micros) {
+    std::this_thread::sleep_until(std::chrono::system_clock::time_point(
+        std::chrono::microseconds(micros)));
+  };
+  for (auto const &level : levels) {
+    auto due = begin + level.first * unit_micros;
+    laser.schedule(!level.second, due);
+    laser.schedule(level.second, due);
+    laser.schedule(level.second, due + unit_micros / 2);
+  }
+  int wrong = 0;
+  for (auto const &level : levels) {
+    at(begin + level.first * unit_micros + unit_micros / 4);
+    wrong += laser.read_level() != level.second;
+  }
+  at(begin + (units + 1) * unit_micros);
+
+  auto writes = laser.writes.load();
+  auto late = laser.max_late_micros.load();
+  std::cout << levels.size() << " laser changes: " << writes << " writes, "
+            << wrong << " read back wrong, at most " << late << "us late"
+            << (laser.realtime ? "" : " without SCHED_FIFO") << std::endl;
+  if (late > max_late_micros) {
+    std::cout << "later than laser_max_late_us " << max_late_micros
+              << std::endl;
+  }
+  return writes == levels.size() && !wrong && max_late_micros >= late ? 0
+                                                                      : 1;
+}
+
+// Plays a morse message through the lockfree mixer with no audio device,
+// from elements each held at its own level, both as one render and as a
+// queue of elements, and checks every element starts on the sample after
+// the one before it ends. Returns the exit status.
+int check_morse_timing(context &ctx, int frequency, int channels,
+                       int chunksize) {
+  struct element {
+    char const *name;
+    Sint16 level;
+    size_t frames;
+  };
+  // lengths that never line up with the callback buffer
+  std::array<element, 4> const elements = {{{"morse_dot.wav", 1000, 1201},
+                                            {"morse_dash.wav", 2000, 3607},
+                                            {"morse_space.wav", 3000, 2803},
+                                            {"morse_gap.wav", 4000, 1194}}};
+  std::array<std::vector<Sint16>, 4> pcm;
+  std::array<Mix_Chunk, 4> chunks{};
+  for (size_t e = 0; elements.size() > e; ++e) {
+    pcm[e].assign(elements[e].frames * channels, elements[e].level);
+    chunks[e].abuf = reinterpret_cast<Uint8 *>(pcm[e].data());
+    chunks[e].alen = pcm[e].size() * sizeof(Sint16);
+    chunks[e].volume = MIX_MAX_VOLUME;
+    ctx.chunks[elements[e].name] = &chunks[e];
+    ctx.ordered_chunks.push_back(&chunks[e]);
+    ctx.ordered_names.push_back(elements[e].name);
+  }
+
+  std::string const message = "... --- ...";
+  std::vector<element const *> expected;
+  size_t expected_samples = 0;
+  for (auto c : message) {
+    expected.push_back(&elements[c == '.' ? 0 : c == '-' ? 1 : 2]);
+    expected.push_back(&elements[3]);
+  }
+  for (auto e : expected) {
+    expected_samples += e->frames * channels;
+  }
+
+  ctx.mixer = std::make_unique<mixer_engine>(64, frequency, channels,
+                                             chunksize);
+  // the brightness timer needs a base, though it never runs here
+  event_init();
+
+  // returns the frame the output first differs from expected at, or -1
+  auto check = [&](char const *how, std::function<sequence_t()> start) {
+    std::vector<Sint16> rendered;
+    std::vector<Sint16> block(size_t(chunksize) * channels);
+    auto started = start();
+    // completions are drained after each buffer, as the completion signal
+    // has them
+    while (started && expected_samples + block.size() > rendered.size()) {
+      std::fill(block.begin(), block.end(), 0);
+      ctx.mixer->mix(reinterpret_cast<Uint8 *>(block.data()),
+                     block.size() * sizeof(Sint16));
+      ctx.drain_mixer_completions();
+      rendered.insert(rendered.end(), block.begin(), block.end());
+    }
+    if (!started) {
+      std::cerr << how << ": failed to start" << std::endl;
+      return false;
+    }
+
+    size_t sample = 0;
+    for (size_t i = 0; expected.size() > i; ++i) {
+      for (auto end = sample + expected[i]->frames * channels; end > sample;
+           ++sample) {
+        if (rendered[sample] != expected[i]->level) {
+          std::cerr << how << ": element " << i << " (" << expected[i]->name
+                    << ") expected " << expected[i]->level << " at frame "
+                    << sample / channels << ", got " << rendered[sample]
+                    << std::endl;
+          return false;
+        }
+      }
+    }
+    for (; rendered.size() > sample; ++sample) {
+      if (rendered[sample]) {
+        std::cerr << how << ": sound after the message at frame "
+                  << sample / channels << std::endl;
+        return false;
+      }
+    }
+    return true;
+  };
+
+  auto rendered = check("render", [&] {
+    return ctx.play_morse(
+        ctx.morse_render_for(message, [&](std::string &morse) {
+          morse = message;
+          return true;
+        }));
+  });
+  // the same elements queued one after another chain in the mixer
+  auto chained = check("queue", [&] {
+    auto first = ctx.play(ctx.name_to_chunk(expected[0]->name));
+    auto last = first;
+    for (size_t i = 1; first && expected.size() > i; ++i) {
+      sequence_t queued = 0;
+      ctx.queue(last, ctx.name_to_chunk(expected[i]->name), queued);
+      last = queued;
+    }
+    return first;
+  });
+  if (!rendered || !chained) {
+    return 1;
+  }
+  std::cout << "morse timing exact: " << expected.size() << " elements over "
+            << expected_samples / channels << " frames in " << chunksize
+            << " frame buffers" << std::endl;
+  return 0;
+}
+
+// Plays, queues after and stops a sample a million times through the
+// lockfree mixer with no audio device, draining completions as the
+// completion signal has them, and checks none of it allocates once warmed
+// up.
+// Returns the exit status.
+int check_sequence_allocations(context &ctx, int frequency, int channels,
+                               int chunksize) {
+  std::vector<Sint16> pcm(size_t(frequency) * channels, 1000);
+  Mix_Chunk chunk{};
+  chunk.abuf = reinterpret_cast<Uint8 *>(pcm.data());
+  chunk.alen = pcm.size() * sizeof(Sint16);
+  chunk.volume = MIX_MAX_VOLUME;
+
+  ctx.mixer = std::make_unique<mixer_engine>(64, frequency, channels,
+                                             chunksize);
+  std::vector<Sint16> block(size_t(chunksize) * channels);
+  long failures = 0;
+  auto cycles = [&](long count) {
+    for (long i = 0; count > i; ++i) {
+      sequence_t queued = 0;
+      auto played = ctx.play(&chunk);
+      ctx.queue(played, &chunk, queued);
+      if (!played || !queued) {
+        ++failures;
+      }
+      ctx.stop(queued);
+      ctx.stop(played);
+      // two voices a cycle, so the 64 voice mixer keeps up
+      if (i % 16 == 15) {
+        ctx.mixer->mix(reinterpret_cast<Uint8 *>(block.data()),
+                       block.size() * sizeof(Sint16));
+        ctx.drain_mixer_completions();
+      }
+    }
+  };
+
+  long const count = 1000000;
+  cycles(1000);
+#ifdef COUNT_ALLOCATIONS
+  auto before = heap_allocations;
+  cycles(count);
+  auto allocations = heap_allocations - before;
+#else
+  cycles(count);
+  size_t allocations = 0;
+#endif
+
+  auto leaked = ctx.sequences.slots.size() - ctx.sequences.free_slots.size();
+  std::cout << count << " play, queue and stop cycles: ";
+#ifdef COUNT_ALLOCATIONS
+  std::cout << allocations << " heap allocations, ";
+#else
+  std::cout << "heap allocations not counted without COUNT_ALLOCATIONS, ";
+#endif
+  std::cout << failures << " failures, " << leaked << " sequences left"
+            << std::endl;
+  return allocations || failures || leaked ? 1 : 0;
+}
+
+// RIFF header for bytes of 16 bit PCM
+void write_wav_header(std::ostream &out, int frequency, int channels,
+                      uint32_t bytes) {
+  auto le = [&](uint32_t value, int size) {
+    for (int i = 0; size > i; ++i) {
+      out.put(char(value >> (8 * i)));
+    }
+  };
+  out.write("RIFF", 4);
+  le(36 + bytes, 4);
+  out.write("WAVEfmt ", 8);
+  le(16, 4);
+  le(1, 2); // PCM
+  le(channels, 2);
+  le(frequency, 4);
+  le(frequency * channels * sizeof(Sint16), 4);
+  le(channels * sizeof(Sint16), 2);
+  le(16, 2);
+  out.write("data", 4);
+  le(bytes, 4);
+}
+
+// Sends the requests in script to the lockfree mixer on a virtual clock
+// starting at time 0 and mixes into a WAV at render_to as fast as it
+// can. Each line is the time in seconds, then the request as sent over
+// HTTP, such as
+//   0.5 play?name=kick.wav&gain=0.8
+// $n in a request is the sequence the nth request replied with, and an
+// end line stops the render at its time; otherwise it runs until
+// nothing is left playing, or fails at max_seconds, as a voice looping
+// for ever would. Requests go in at the start of the buffer they fall
+// in, as they would live, and at= starts on its exact frame. The
+// replies are written to stdout. Returns the exit status.
+int render_script(context &ctx, std::string const &script,
+                  std::string const &render_to, int chunksize,
+                  double max_seconds) {
+  struct scripted_request {
+    int64_t micros;
+    std::string request;
+  };
+  std::vector<scripted_request> requests;
+  int64_t end_micros = std::numeric_limits<int64_t>::max();
+  std::ifstream in(script);
+  if (!in) {
+    std::cerr << "Can't read script " << script << std::endl;
+    return 1;
+  }
+  std::string line;
+  for (int number = 1; std::getline(in, line); ++number) {
+    std::istringstream iss{line};
+    std::string time, request;
+    iss >> time >> request;
+    if (time.empty() || '#' == time[0]) {
+      continue;
+    }
+    scripted_request scripted;
+    if (!parse_time_micros(time, scripted.micros) || request.empty()) {
+      std::cerr << script << ":" << number << ": expected seconds then a "
+                << "request, got " << line << std::endl;
+      return 1;
+    }
+    if ("end" == request) {
+      end_micros = std::min(end_micros, scripted.micros);
+      continue;
+    }
+    scripted.request = '/' == request[0] ? request : "/" + request;
+    requests.push_back(scripted);
+  }
+  std::stable_sort(requests.begin(), requests.end(),
+                   [](scripted_request const &a, scripted_request const &b) {
+                     return a.micros < b.micros;
+                   });
+
+  auto &mixer = *ctx.mixer;
+  std::ofstream wav(render_to, std::ios::binary);
+  write_wav_header(wav, mixer.frequency, mixer.channels, 0);
+  std::vector<Sint16> block(size_t(chunksize) * mixer.channels);
+  std::vector<sequence_t> replied;
+  uint64_t frames = 0;
+  bool ends = end_micros != std::numeric_limits<int64_t>::max();
+  auto end_frame = ends ? uint64_t(end_micros) * mixer.frequency / 1000000
+                        : uint64_t(max_seconds * mixer.frequency);
+  size_t next = 0;
+  bool capped = false;
+  auto started = std::chrono::steady_clock::now();
+  for (;;) {
+    for (; requests.size() > next &&
+           int64_t(frames * 1000000 / mixer.frequency) >= requests[next].micros;
+         ++next) {
+      auto request = requests[next].request;
+      for (auto dollar = request.find('$'); dollar != std::string::npos;
+           dollar = request.find('$', dollar + 1)) {
+        auto digits = request.find_first_not_of("0123456789", dollar + 1);
+        auto n = std::atoi(request.substr(dollar + 1, digits).c_str());
+        if (n < 1 || size_t(n) > replied.size()) {
+          std::cerr << "No reply " << n << " yet for " << request
+                    << std::endl;
+          return 1;
+        }
+        request.replace(dollar, digits - dollar,
+                        std::to_string(replied[n - 1]));
+      }
+      auto uri = std::unique_ptr<evhttp_uri, decltype(&evhttp_uri_free)>(
+          evhttp_uri_parse(request.c_str()), &evhttp_uri_free);
+      if (!uri) {
+        std::cerr << "Bad request " << request << std::endl;
+        return 1;
+      }
+      std::ostringstream out;
+      ctx.handle_request(out, uri.get());
+      ctx.enforce_sample_budget();
+      std::cout << "> " << request << std::endl << out.str();
+
+      sequence_t sequence = 0;
+      std::istringstream reply{out.str()};
+      while (std::getline(reply, line)) {
+        if (starts_with("PLAYING ", line) || starts_with("QUEUED ", line)) {
+          sequence = std::stoull(line.substr(line.find(' ') + 1));
+        }
+      }
+      replied.push_back(sequence);
+    }
+
+    auto playing =
+        ctx.sequences.slots.size() != ctx.sequences.free_slots.size();
+    if (!ends && requests.size() == next && !playing) {
+      break;
+    }
+    if (frames >= end_frame) {
+      capped = !ends;
+      break;
+    }
+    auto count = std::min<uint64_t>(chunksize, end_frame - frames);
+    std::fill(block.begin(), block.end(), 0);
+    mixer.mix(reinterpret_cast<Uint8 *>(block.data()),
+              count * mixer.channels * sizeof(Sint16));
+    ctx.drain_mixer_completions();
+    wav.write(reinterpret_cast<char const *>(block.data()),
+              count * mixer.channels * sizeof(Sint16));
+    frames += count;
+  }
+
+  wav.seekp(0);
+  write_wav_header(wav, mixer.frequency, mixer.channels,
+                   frames * mixer.channels * sizeof(Sint16));
+  wav.close();
+  if (!wav) {
+    std::cerr << "Failed writing " << render_to << std::endl;
+    return 1;
+  }
+  if (capped) {
+    std::cerr << "Still playing after render_max_seconds, " << max_seconds
+              << "s; a script looping for ever needs an end line"
+              << std::endl;
+    return 1;
+  }
+  auto took = std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                            started)
+                  .count();
+  auto seconds = double(frames) / mixer.frequency;
+  // stdout has the replies, so they can be compared between runs
+  std::cerr << "rendered " << seconds << "s to " << render_to << " in "
+            << took << "s, " << seconds / took << " times real time"
+            << std::endl;
+  return 0;
+}
 } // namespace
 
 int main(int argc, char *argv[]) {
@@ -1189,11 +7636,91 @@ int main(int argc, char *argv[]) {
       "duration")("sample-files", po::value<std::vector<std::string>>(),
                   "OGG, WAV or MP3 sample files")(
       "gpio_path", po::value<std::string>(),
-      "path to GPIO pin for the laser relay")(
+      "GPIO for the laser relay: a value file such as "
+      "/sys/class/gpio/gpio17/value, or a character device such as "
+      "/dev/gpiochip0 with gpio_line")(
+      "gpio_line", po::value<int>()->default_value(0),
+      "Line offset on the gpio_path character device")(
       "gpio_off_value", po::value<int>()->default_value(1),
       "value for the GPIO pin when the laser is off")(
       "allocate_sdl_channels", po::value<int>()->default_value(2048),
-      "Number of SDL channels to mix together") (
+      "Number of SDL channels to mix together")(
+      "voice_stealing", po::value<std::string>()->default_value("none"),
+      "When allocate_sdl_channels voices are sounding: none fails new "
+      "sequences, oldest, quietest or priority fades one out to make room")(
+      "sample_priority", po::value<std::vector<std::string>>()->composing(),
+      "sample=priority, default 0; priority stealing only takes voices of "
+      "equal or lower priority, the lowest first")(
+      "steal_fade_ms", po::value<int>()->default_value(10),
+      "Milliseconds a stolen voice fades out over")(
+      "steal_fade_voices", po::value<int>()->default_value(16),
+      "Voices kept beyond allocate_sdl_channels for stolen voices to fade "
+      "out on")(
+      "sequence_slots", po::value<size_t>()->default_value(4096),
+      "Number of sequences that can be playing or queued at once")(
+      "load_threads", po::value<int>()->default_value(0),
+      "Threads decoding sample files at startup, 0 for one per core")(
+      "load_samples_in_background", po::value<bool>()->default_value(false),
+      "Start listening before the samples are decoded and answer LOADING "
+      "for samples that are not ready yet; not with sample_memory_budget")(
+      "sample_memory_budget", po::value<size_t>()->default_value(0),
+      "Bytes of decoded samples to keep resident; when set, samples are "
+      "decoded on first play and the least recently used freed, 0 decodes "
+      "everything at startup")(
+      "morse_cache_size", po::value<size_t>()->default_value(16),
+      "Number of rendered morse messages to keep for playing again")(
+      "watch_sample_dirs", po::value<bool>()->default_value(false),
+      "Watch the directories of the sample files with inotify and load new "
+      "or changed samples without restarting")(
+      "sample_cache_dir", po::value<std::string>(),
+      "Directory of samples pre-decoded to the output format, mmapped at "
+      "startup and filled in for samples that are missing or stale")(
+      "lockfree_mixer", po::value<bool>()->default_value(false),
+      "Mix in-house from a lock-free command ring instead of SDL_mixer "
+      "channels; allocate_sdl_channels sets the number of voices")(
+      "native_rate_samples", po::value<bool>()->default_value(false),
+      "Keep WAV samples at their own rate and resample them while mixing, "
+      "so the output frequency can change without decoding them again; "
+      "needs lockfree_mixer")(
+      "resampler_taps", po::value<int>()->default_value(16),
+      "Filter length of the resampler used for native_rate_samples and the "
+      "rate parameter, even; more is cleaner and costs more CPU, 2 is "
+      "linear interpolation")(
+      "benchmark_mixer",
+      "Time the mixing kernels at 64, 512 and 2048 voices and exit")(
+      "benchmark_udp_parsing",
+      "Time the text and binary UDP protocols per request, for reset, "
+      "play, queue and stop, and exit")(
+      "benchmark_idle_cpu", po::value<double>(),
+      "Start up as usual, then after this many seconds of serving print the "
+      "CPU the whole process used meanwhile and exit")(
+      "check_sequence_allocations",
+      "Play, queue and stop a million sequences through the lockfree mixer "
+      "offline, check the heap is left alone, in a build with "
+      "COUNT_ALLOCATIONS such as make audiomixserver_check, and exit")(
+      "check_morse_timing",
+      "Render a morse message through the lockfree mixer offline, check "
+      "every element starts on the sample its predecessor ends and exit")(
+      "check_fire_client",
+      "Send bursts, repeats and failing requests through the fire server "
+      "client to a local stub server, check they are bounded, coalesced and "
+      "retried with backoff over kept-alive connections, and exit")(
+      "check_laser_edges",
+      "Flash SOS on the gpio_path laser, check it is written once a change "
+      "and no later than laser_max_late_us, and exit")(
+      "laser_max_late_us", po::value<int>()->default_value(5000),
+      "How late check_laser_edges lets a write be, in microseconds; a "
+      "quarter of its 20ms dot by default")(
+      "render_to", po::value<std::string>(),
+      "Run script on a virtual clock with no sound device, mixing as fast "
+      "as possible into this WAV file, and exit; needs lockfree_mixer")(
+      "script", po::value<std::string>(),
+      "Requests for render_to, one a line: the time in seconds, then the "
+      "request as sent over HTTP; $n is the sequence the nth request "
+      "replied with, and an end line stops the render")(
+      "render_max_seconds", po::value<double>()->default_value(3600),
+      "Longest render of a script with no end line; one still playing "
+      "then, such as with loop=-1, fails")(
       "bind_address", po::value<std::string>()->default_value("0.0.0.0"),
       "Address to listen on for HTTP")
     ("fire_server_address", po::value<std::string>()->default_value("192.168.1.20"),
@@ -1201,14 +7728,40 @@ int main(int argc, char *argv[]) {
     ("fire_server_port", po::value<int>()->default_value(80),
       "HTTP port for the Pico W fire server")    
     ("fire_server_start_path", po::value<std::string>()->default_value("fire"),
-      "Address of the Pico W that starts the fire")
+      "Path requested from the fire server as each morse message starts")
+    ("fire_server_connections", po::value<int>()->default_value(2),
+      "Kept-alive connections to the fire server, each with at most one "
+      "request in flight")
+    ("fire_server_timeout_ms", po::value<int>()->default_value(1000),
+      "Milliseconds before a fire server request fails")
+    ("fire_server_queue", po::value<size_t>()->default_value(16),
+      "Fire server requests waiting for a connection before the oldest is "
+      "dropped")
+    ("fire_server_retries", po::value<int>()->default_value(3),
+      "Times a failed fire server request is retried, after 100ms doubling "
+      "up to 5s")
+    ("fire_server_coalesce_ms", po::value<int>()->default_value(500),
+      "A fire server path requested again within this many milliseconds "
+      "of being sent is not sent again")
     ("bind_port",
                                        po::value<int>()->default_value(13231),
                                        "Port to listen on for HTTP")(
       "bind_port_udp", po::value<int>()->default_value(13231),
-      "Port to listen on for UDP")("visuals",
+      "Port to listen on for UDP")(
+      "udp_threads", po::value<int>()->default_value(0),
+      "Threads each receiving and parsing UDP on their own SO_REUSEPORT "
+      "socket, 0 to handle UDP on the libevent thread")(
+      "udp_batch_size", po::value<int>()->default_value(32),
+      "Datagrams received with one recvmmsg and answered with one sendmmsg, "
+      "on each --udp_threads thread if any, 1 for a recvfrom and sendto per "
+      "datagram")(
+      "log_level", po::value<std::string>()->default_value("info"),
+      "Least severe messages logged: debug, info, warning, error or off; "
+      "the checks and benchmarks default to warning")("visuals",
                                    po::value<bool>()->default_value(true),
-                                   "Open GL visualisations")
+                                   "Open GL visualisations; false runs "
+                                   "headless, with no SDL video and the "
+                                   "libevent loop on the main thread")
                                    ("flash_screen",
                                     po::value<bool>()->default_value(false), "Turn screen white when playing morse")
     ("3d-model-paths", po::value<std::vector<std::string>>(), "paths to 3D model files");
@@ -1228,6 +7781,92 @@ int main(int argc, char *argv[]) {
     return 1;
   }
 
+  auto level = std::find(std::begin(log_level_names),
+                         std::end(log_level_names),
+                         vm["log_level"].as<std::string>());
+  if (std::end(log_level_names) == level) {
+    std::cerr << "Unknown log_level " << vm["log_level"].as<std::string>()
+              << std::endl;
+    return 1;
+  }
+  log_threshold = level - std::begin(log_level_names);
+  auto checking = vm.count("benchmark_udp_parsing") ||
+                  vm.count("check_sequence_allocations") ||
+                  vm.count("check_morse_timing") ||
+                  vm.count("check_laser_edges") ||
+                  vm.count("check_fire_client") ||
+                  vm.count("benchmark_mixer") ||
+                  vm.count("benchmark_idle_cpu");
+  if (checking && vm["log_level"].defaulted()) {
+    log_threshold = level_warning;
+  }
+  // stdout is kept for the replies when rendering
+  logger.start(vm.count("render_to") ? stderr : stdout);
+
+  if (vm.count("benchmark_udp_parsing")) {
+    context ctx(vm);
+    return benchmark_udp_parsing(ctx, vm["frequency"].as<int>(),
+                                 vm["channels"].as<int>(),
+                                 vm["chunksize"].as<int>());
+  }
+
+  if (vm.count("check_sequence_allocations")) {
+    context ctx(vm);
+    return check_sequence_allocations(ctx, vm["frequency"].as<int>(),
+                                      vm["channels"].as<int>(),
+                                      vm["chunksize"].as<int>());
+  }
+
+  if (vm.count("check_fire_client")) {
+    return check_fire_client();
+  }
+
+  if (vm.count("check_laser_edges")) {
+    if (!vm.count("gpio_path")) {
+      std::cerr << "check_laser_edges needs gpio_path" << std::endl;
+      return 1;
+    }
+    return check_laser_edges(vm["gpio_path"].as<std::string>(),
+                             vm["gpio_line"].as<int>(),
+                             vm["gpio_off_value"].as<int>(),
+                             vm["laser_max_late_us"].as<int>());
+  }
+
+  if (vm.count("check_morse_timing")) {
+    context ctx(vm);
+    return check_morse_timing(ctx, vm["frequency"].as<int>(),
+                              vm["channels"].as<int>(),
+                              vm["chunksize"].as<int>());
+  }
+
+  if (vm.count("benchmark_mixer")) {
+    benchmark_mixer(vm["frequency"].as<int>(), vm["channels"].as<int>(),
+                    vm["chunksize"].as<int>(),
+                    vm["resampler_taps"].as<int>());
+    return 0;
+  }
+
+  // under a budget nothing is decoded at startup, so there is nothing
+  // to do in the background
+  if (vm["load_samples_in_background"].as<bool>() &&
+      vm["sample_memory_budget"].as<size_t>()) {
+    std::cerr << "load_samples_in_background can't be used with "
+              << "sample_memory_budget, which decodes samples on first play"
+              << std::endl;
+    return 1;
+  }
+
+  auto rendering = vm.count("render_to");
+  if (rendering &&
+      (!vm.count("script") || !vm["lockfree_mixer"].as<bool>())) {
+    std::cerr << "render_to needs script and lockfree_mixer" << std::endl;
+    return 1;
+  }
+  if (rendering) {
+    // samples are still loaded through SDL_mixer, but nothing is played
+    setenv("SDL_AUDIODRIVER", "dummy", 1);
+  }
+
   int ret = SDL_Init(SDL_INIT_AUDIO);
 
   if (ret < 0) {
@@ -1243,7 +7882,34 @@ int main(int argc, char *argv[]) {
   }
 
   context ctx(vm);
-  Mix_AllocateChannels(vm["allocate_sdl_channels"].as<int>());
+  if (!ctx.init_voice_stealing()) {
+    return 7;
+  }
+  if (!vm["lockfree_mixer"].as<bool>()) {
+    Mix_AllocateChannels(context::voice_count(vm));
+  }
+
+  if (rendering) {
+    if (!ctx.init_sample_cache()) {
+      std::cerr << "init_sample_cache" << std::endl;
+    }
+    if (vm.count("sample-files")) {
+      ctx.load_audio_from_filenames(
+          vm["sample-files"].as<std::vector<std::string>>());
+    }
+    if (!event_init()) {
+      std::cerr << "event_init" << std::endl;
+      return 5;
+    }
+    if (!ctx.init_mixer_engine(false)) {
+      std::cerr << "init_mixer_engine" << std::endl;
+      return 6;
+    }
+    return render_script(ctx, vm["script"].as<std::string>(),
+                         vm["render_to"].as<std::string>(),
+                         vm["chunksize"].as<int>(),
+                         vm["render_max_seconds"].as<double>());
+  }
 
   if (vm.count("3d-model-paths")) {
     ctx.load_3d_models_from_paths(vm["3d-model-paths"].as<std::vector<std::string>>());
@@ -1295,10 +7961,12 @@ int main(int argc, char *argv[]) {
     });
   }
 
-  global_ctx = &ctx; // as finished_channel needs a global
-  Mix_ChannelFinished(finished_channel);
+  if (!ctx.init_sample_cache()) {
+    std::cerr << "init_sample_cache" << std::endl;
+  }
 
-  if (vm.count("sample-files")) {
+  auto background_loading = vm["load_samples_in_background"].as<bool>();
+  if (vm.count("sample-files") && !background_loading) {
     ctx.load_audio_from_filenames(vm["sample-files"].as<std::vector<std::string>>());
   }
 
@@ -1307,6 +7975,32 @@ int main(int argc, char *argv[]) {
     return 5;
   }
 
+  if (vm["lockfree_mixer"].as<bool>() && !ctx.init_mixer_engine()) {
+    std::cerr << "init_mixer_engine" << std::endl;
+    return 6;
+  }
+
+  if (!ctx.init_completions()) {
+    std::cerr << "init_completions" << std::endl;
+    return 8;
+  }
+  if (!ctx.init_laser()) {
+    std::cerr << "init_laser" << std::endl;
+  }
+  global_ctx = &ctx; // as post_finished_channel needs a global
+  Mix_ChannelFinished(post_finished_channel);
+
+  if (vm.count("sample-files") && background_loading) {
+    ctx.load_audio_in_background(
+        vm["sample-files"].as<std::vector<std::string>>());
+  }
+
+  if (vm.count("sample-files") && vm["watch_sample_dirs"].as<bool>() &&
+      !ctx.init_sample_watcher(
+          vm["sample-files"].as<std::vector<std::string>>())) {
+    std::cerr << "init_sample_watcher" << std::endl;
+  }
+
   if (!ctx.init_udp()) {
     std::cerr << "init_udp" << std::endl;
   }
@@ -1317,6 +8011,36 @@ int main(int argc, char *argv[]) {
     std::cerr << "init_fire_server" << std::endl;
   }
 
+  if (vm.count("benchmark_idle_cpu")) {
+    std::thread([seconds = vm["benchmark_idle_cpu"].as<double>()] {
+      auto cpu_seconds = [] {
+        rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+               (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+      };
+      auto cpu_before = cpu_seconds();
+      auto begin = std::chrono::steady_clock::now();
+      std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+      auto cpu = cpu_seconds() - cpu_before;
+      std::chrono::duration<double> elapsed =
+          std::chrono::steady_clock::now() - begin;
+      std::cout << "idle for " << elapsed.count() << "s: " << cpu
+                << "s of CPU, " << 100 * cpu / elapsed.count()
+                << "% of a core" << std::endl;
+      std::exit(0);
+    }).detach();
+  }
+
+  if (!vm["visuals"].as<bool>()) {
+    // headless, so no SDL events to wait for
+    if (event_dispatch() == -1) {
+      std::cerr << "event_dispatch" << std::endl;
+      return 7;
+    }
+    return 0;
+  }
+
   auto libevent_thread = std::thread([] {
     if (event_dispatch() == -1) {
       std::cerr << "event_dispatch" << std::endl;
@@ -1326,24 +8050,24 @@ int main(int argc, char *argv[]) {
 
   // SDL demands the main thread under Mac OS X or else gets
   // "nextEventMatchingMask should only be called from the Main
-  // Thread!"
-  for (;;) {
-    SDL_Event event;
-    while (SDL_PollEvent(&event)) {
-      switch (event.type) {
-      case SDL_KEYUP:
-        if (event.key.keysym.sym == SDLK_ESCAPE) {
-          std::cout << "Exiting due to SDL_KEYUP SDLK_ESCAPE" << std::endl;
-          std::exit(0);
-        }
-
-        break;
-      case SDL_QUIT:
-        std::cout << "Exiting due to SDL_QUIT" << std::endl;
+  // Thread!" It blocks until there is an event, leaving the core to the
+  // mixer and network threads.
+  SDL_Event event;
+  while (SDL_WaitEvent(&event)) {
+    switch (event.type) {
+    case SDL_KEYUP:
+      if (event.key.keysym.sym == SDLK_ESCAPE) {
+        std::cout << "Exiting due to SDL_KEYUP SDLK_ESCAPE" << std::endl;
         std::exit(0);
       }
+
+      break;
+    case SDL_QUIT:
+      std::cout << "Exiting due to SDL_QUIT" << std::endl;
+      std::exit(0);
     }
   }
-
+  std::cerr << "SDL_WaitEvent " << SDL_GetError() << std::endl;
+  libevent_thread.join();
   return 0;
 }